@@ -3,22 +3,41 @@
 #include <sys/types.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <strings.h>
 #include <unistd.h>
 #include <assert.h>
 #include <stdbool.h>
 #include <pthread.h>
 #include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <limits.h>
 #include <sched.h>
 
 #include "memlib.h"
 #include "malloc.h"
 #include "mm_thread.h"
+#include "a2alloc.h"
+#include "topology.h"
 
 // when we see memory which is full of this, we know we have a problem
 // doubles for wiping out no-longer-used data structs
 // note that EMPTY_MEM_CHAR = 0x23
 #define EMPTY_MEM_CHAR      '#'
+// what freed memory is filled with, FREED_MEM_CHAR = 0x25
+#define FREED_MEM_CHAR      '%'
+
+// whether blocks are filled with EMPTY_MEM_CHAR when handed out and with
+// FREED_MEM_CHAR when freed. Release builds don't touch the memory at all;
+// liba2alloc_dbg does both. Pick one with -DA2ALLOC_POISON=...
+#define POISON_NONE         0
+#define POISON_ON_ALLOC     1
+#define POISON_ON_FREE      2
+#define POISON_DEBUG        (POISON_ON_ALLOC | POISON_ON_FREE)
+#ifndef A2ALLOC_POISON
+#define A2ALLOC_POISON      POISON_NONE
+#endif
 
 // DEBUGGING FLAGS
 #define DB_MALLOC           2
@@ -34,6 +53,9 @@
 #define DB_FREE_LARGE       2048
 #define DB_LARGELIST        4096
 #define DB_RECLAIM          8192
+#define DB_TCACHE           16384
+#define DB_REMOTE           32768
+#define DB_PAGEMAP          65536
 #define DB_FLAGS            (0)
 //#define DB_FLAGS            (DB_FREE | DB_MALLOC | DB_INIT | DB_RECLAIM | DB_LARGELIST)
 // DB_FREE | DB_MALLOC | DB_MAKE_FREENODE | DB_MALLOC_TOPLVL | DB_RECLAIM | DB_LARGELIST
@@ -42,20 +64,340 @@
 #define TOGGLE_MOVE_SMALLEST_TO_FRONT       1
 #define FEATURES                            (0)
 
+// how a superblock keeps track of its free segments, pick one at build time
+// with -DSB_FREE_TRACKING=SB_TRACK_BITMAP (see A2ALLOC_FLAGS in allocators/Makefile)
+// + SB_TRACK_FREELIST: a linked list threaded through the free segments
+// + SB_TRACK_BITMAP: one bit per segment in the superblock header, so popping
+//   and pushing never touch the segments themselves
+#define SB_TRACK_FREELIST   0
+#define SB_TRACK_BITMAP     1
+#ifndef SB_FREE_TRACKING
+#define SB_FREE_TRACKING    SB_TRACK_FREELIST
+#endif
+
 // unfortunately must explicitly keep as long :(
-const unsigned long SB_SIZE = 4096;
-const double F_thresh = 0.25;
-const unsigned int K_thresh = 1;
+#define SB_BYTES            4096
+const unsigned long SB_SIZE = SB_BYTES;
+// Thresholds per tier (see maybe_move_up_tier and llc_heap_overflow):
+// + a per-CPU heap with less than CPU_F_THRESH of its segments in use gives
+//   reclaimed superblocks to the next tier as long as it keeps CPU_K_THRESH
+// + an LLC heap only ever holds empty superblocks, so it has no fraction in
+//   use to test; once it holds more than LLC_K_THRESH it passes the surplus
+//   on to heap 0 until it's down to LLC_KEEP_FRAC of LLC_K_THRESH
+#ifndef CPU_F_THRESH
+#define CPU_F_THRESH        0.25
+#endif
+#ifndef CPU_K_THRESH
+#define CPU_K_THRESH        1
+#endif
+#ifndef LLC_KEEP_FRAC
+#define LLC_KEEP_FRAC       0.5
+#endif
+#ifndef LLC_K_THRESH
+#define LLC_K_THRESH        64
+#endif
+const double F_thresh = CPU_F_THRESH;
+const unsigned int K_thresh = CPU_K_THRESH;
+const double LLC_keep_frac = LLC_KEEP_FRAC;
+const unsigned int LLC_K_thresh = LLC_K_THRESH;
+// how many reclaimed superblocks move between a heap and heap 0 at a time:
+// a heap below the emptiness threshold gives back up to this many at once,
+// and a heap that finds none of its own takes up to this many
+#ifndef SB_TRANSFER_BATCH
+#define SB_TRANSFER_BATCH   4
+#endif
 
 // segment stuff. make sure that this stuff all matches up
 // no segment is greater than half the SB_SIZE
-const unsigned int SEG_SIZES[] = {64, 128, 256, 512, 1024, 2048};
-#define NUM_SEGS            6
+// SEG_SIZES is generated by init_size_classes: between each pair of powers
+// of two there are four classes (quarter-power-of-two spacing), but classes
+// are never closer than SEG_ALIGN apart, which gives 8..64 in steps of 8
+#define SEG_ALIGN           8
+#define MIN_SEG             8
+#define MAX_SEG             2048
+#define NUM_SEGS            28
+static unsigned int SEG_SIZES[NUM_SEGS];
+// size_to_seg_idx[(size + SEG_ALIGN - 1) / SEG_ALIGN] is the smallest class that fits size
+static unsigned char size_to_seg_idx[MAX_SEG / SEG_ALIGN + 1];
+// enough bits for every segment of the smallest class
+#define SB_BITMAP_WORDS     ((SB_BYTES / MIN_SEG + 63) / 64)
+// SEG_RECIPS[i] is 2^32 / SEG_SIZES[i] rounded up: an offset into a
+// superblock times it, shifted right by 32, is the index of the segment the
+// offset is in, without dividing on the free path
+static unsigned long SEG_RECIPS[NUM_SEGS];
+
+// superblocks are SB_SIZE << i bytes for i < NUM_SB_SIZES. Each class gets the
+// smallest of those holding SB_MIN_SEGS of its segments (or the largest one),
+// so big classes don't waste half a superblock on the header and refill in
+// bigger batches. SEG_SB_SIZES is filled in by init_size_classes
+#define NUM_SB_SIZES        5
+#define SB_MAX_SIZE         (SB_BYTES << (NUM_SB_SIZES - 1))
+#define SB_MIN_SEGS         32
+static unsigned int SEG_SB_SIZES[NUM_SEGS];
+
+// blocks of at least A2ALLOC_MMAP_THRESHOLD bytes get an anonymous mapping of
+// their own instead of coming out of the heap segment: freeing one unmaps it
+// right away and mm_realloc grows it with mremap. Pick the threshold at build
+// time with -DA2ALLOC_MMAP_THRESHOLD=... (see A2ALLOC_FLAGS in allocators/Makefile)
+#ifndef A2ALLOC_MMAP_THRESHOLD
+#define A2ALLOC_MMAP_THRESHOLD  (1UL << 20)
+#endif
+#if A2ALLOC_MMAP_THRESHOLD <= MAX_SEG
+#error "A2ALLOC_MMAP_THRESHOLD must be above MAX_SEG"
+#endif
+
+// thread cache: each thread keeps at most TCACHE_MAX_BYTES (and at most
+// TCACHE_MAX_COUNT segments) per size class, so the memory hidden from the
+// heaps is bounded by a constant per thread and the blowup bound still holds
+#define TCACHE_MAX_COUNT    64
+#define TCACHE_MIN_COUNT    4
+#define TCACHE_MAX_BYTES    8192
+
+// per-CPU caches on top of restartable sequences, used instead of the thread
+// caches by threads the kernel has registered for rseq. Off by default: a
+// malloc/free pair through them costs about 8ns against 5-6ns through the
+// thread cache. -DA2ALLOC_RSEQ=1 turns them on where glibc provides rseq
+// (x86-64 only)
+#ifndef A2ALLOC_RSEQ
+#define A2ALLOC_RSEQ        0
+#endif
+#if A2ALLOC_RSEQ && !(defined(__x86_64__) && defined(__linux__) && __has_include(<sys/rseq.h>))
+#error "A2ALLOC_RSEQ needs x86-64 Linux and a glibc with <sys/rseq.h>"
+#endif
+#if A2ALLOC_RSEQ
+#include <sys/rseq.h>
+#endif
+
+// how a thread picks its heap, pick one at build time with
+// -DA2ALLOC_HEAP_POLICY=HEAP_POLICY_THREAD (see A2ALLOC_FLAGS in allocators/Makefile)
+// + HEAP_POLICY_CPU: the heap of the CPU it happens to be running on
+// + HEAP_POLICY_THREAD: a heap of its own kept in TLS, starting with its first
+//   CPU's, and moved to a less crowded heap when it keeps finding the lock of
+//   its heap taken. Threads then use their thread caches, not the per-CPU ones
+// Either way a2alloc_bind_heap pins a thread to a heap of the caller's choice
+#define HEAP_POLICY_CPU     0
+#define HEAP_POLICY_THREAD  1
+#ifndef A2ALLOC_HEAP_POLICY
+#define A2ALLOC_HEAP_POLICY HEAP_POLICY_CPU
+#endif
+// under HEAP_POLICY_THREAD, a thread that had to wait for its heap's lock on
+// at least REBALANCE_WAITS of REBALANCE_WINDOW acquisitions changes heaps
+#define REBALANCE_WINDOW    64
+#define REBALANCE_WAITS     8
+
+// how far down its reclaimed superblocks a heap looks for one of the right class
+#define RECLAIM_SCAN        8
+
+// each heap keeps its superblocks of a class in SB_FULLNESS_BINS lists by the
+// fraction of segments in use (bin b holds [b, b + 1) / SB_FULLNESS_BINS),
+// plus one more for superblocks with nothing free
+#define SB_FULLNESS_BINS    4
+#define SB_FULL_BIN         SB_FULLNESS_BINS
+#define SB_NUM_BINS         (SB_FULLNESS_BINS + 1)
+
+// before growing the address space a heap may adopt a superblock of the class
+// it needs from another heap: it tries up to STEAL_HEAPS other heaps, takes
+// only superblocks from the bins below STEAL_MAX_BIN (at least half free) and
+// looks at most STEAL_SCAN deep into each bin
+#define STEAL_HEAPS         4
+#define STEAL_MAX_BIN       (SB_FULLNESS_BINS / 2)
+#define STEAL_SCAN          8
+
+// a process gets at most HEAPS_PER_CPU per-CPU heaps for each CPU's worth of
+// time it may use (see topo_num_usable). Under HEAP_POLICY_CPU no more get
+// made than CPUs show up, but threads and bound workers may use them all
+#define HEAPS_PER_CPU       2
+// heaps that haven't refilled or flushed anything between two scans are
+// folded into heap 0; a scan runs every HEAP_FOLD_INTERVAL new superblocks
+#define HEAP_FOLD_INTERVAL  64
+
+// what the allocator's locks are, pick one at build time with
+// -DA2ALLOC_LOCK=LOCK_TICKET (see A2ALLOC_FLAGS in allocators/Makefile)
+// + LOCK_PTHREAD: a default pthread mutex, which sleeps as soon as it's taken
+// + LOCK_ADAPTIVE: a glibc adaptive mutex, which spins a while first
+// + LOCK_TICKET: a FIFO ticket lock; the next thread in line spins up to
+//   LOCK_SPINS times, the others and then it too sleep on a futex. Handing
+//   the lock over in order stalls badly once there are more threads than
+//   CPUs, since the next in line may not be running
+// Spinning only pays off with idle CPUs to spin on, so the default stays
+// LOCK_PTHREAD
+// -DA2ALLOC_LOCK_STATS=1 makes every lock count its acquisitions, how many of
+// them had to wait and for how long (see a2alloc_print_locks)
+#define LOCK_PTHREAD        0
+#define LOCK_ADAPTIVE       1
+#define LOCK_TICKET         2
+#ifndef A2ALLOC_LOCK
+#define A2ALLOC_LOCK        LOCK_PTHREAD
+#endif
+#ifndef A2ALLOC_LOCK_STATS
+#define A2ALLOC_LOCK_STATS  0
+#endif
+#define LOCK_SPINS          256
 
 // debugging macro, for sanity
 
 #define DEBUG(d, ...) do { if (d & DB_FLAGS) printf(__VA_ARGS__); } while (0)
 
+///////////////////////////////////// LOCKS /////////////////////////////////////
+// Every lock in the allocator is a struct alloc_lock, so their kind is picked
+// in one place (A2ALLOC_LOCK) and each one can keep its own counters. The
+// counters are only written by whoever holds the lock, so they need no atomics.
+
+struct alloc_lock {
+#if A2ALLOC_LOCK == LOCK_TICKET
+    // the ticket the next thread to arrive gets, the one whose turn it is,
+    // and how many threads sleep waiting for serving to change
+    unsigned int next;
+    unsigned int serving;
+    unsigned int parked;
+#else
+    pthread_mutex_t mutex;
+#endif
+#if A2ALLOC_LOCK_STATS
+    unsigned long acquired;
+    unsigned long contended;
+    unsigned long wait_cycles;
+#endif
+};
+
+#if A2ALLOC_LOCK == LOCK_TICKET
+#define ALLOC_LOCK_INITIALIZER { .next = 0 }
+#elif A2ALLOC_LOCK == LOCK_ADAPTIVE
+#define ALLOC_LOCK_INITIALIZER { .mutex = PTHREAD_ADAPTIVE_MUTEX_INITIALIZER_NP }
+#else
+#define ALLOC_LOCK_INITIALIZER { .mutex = PTHREAD_MUTEX_INITIALIZER }
+#endif
+
+void lock_init(struct alloc_lock * lock)
+{
+#if A2ALLOC_LOCK == LOCK_TICKET
+    lock->next = 0;
+    lock->serving = 0;
+    lock->parked = 0;
+#else
+    pthread_mutexattr_t attrs;
+    pthread_mutexattr_init(&attrs);
+#if A2ALLOC_LOCK == LOCK_ADAPTIVE
+    pthread_mutexattr_settype(&attrs, PTHREAD_MUTEX_ADAPTIVE_NP);
+#endif
+    pthread_mutex_init(&lock->mutex, &attrs);
+    pthread_mutexattr_destroy(&attrs);
+#endif
+#if A2ALLOC_LOCK_STATS
+    lock->acquired = 0;
+    lock->contended = 0;
+    lock->wait_cycles = 0;
+#endif
+}
+
+/**
+ * Timestamp for measuring waits: TSC cycles, or nanoseconds without a TSC
+ */
+static inline unsigned long lock_clock(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_ia32_rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+#endif
+}
+
+static inline void lock_pause(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#else
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+#endif
+}
+
+/**
+ * Take the lock if nobody holds it
+ * Return true if we got it
+ */
+bool lock_try(struct alloc_lock * lock)
+{
+#if A2ALLOC_LOCK == LOCK_TICKET
+    // it's free when nobody has taken a ticket past the one being served
+    unsigned int ticket = __atomic_load_n(&lock->serving, __ATOMIC_ACQUIRE);
+    if (!__atomic_compare_exchange_n(&lock->next, &ticket, ticket + 1, false,
+                                     __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        return false;
+    }
+#else
+    if (pthread_mutex_trylock(&lock->mutex) != 0) return false;
+#endif
+#if A2ALLOC_LOCK_STATS
+    lock->acquired++;
+#endif
+    return true;
+}
+
+/**
+ * Take the lock, waiting for it if need be
+ * Return true if we had to wait
+ */
+bool lock_acquire(struct alloc_lock * lock)
+{
+#if A2ALLOC_LOCK == LOCK_TICKET
+    unsigned int ticket = __atomic_fetch_add(&lock->next, 1, __ATOMIC_RELAXED);
+    unsigned int serving = __atomic_load_n(&lock->serving, __ATOMIC_ACQUIRE);
+    bool waited = serving != ticket;
+#else
+    bool waited = pthread_mutex_trylock(&lock->mutex) != 0;
+#endif
+    if (!waited) {
+#if A2ALLOC_LOCK_STATS
+        lock->acquired++;
+#endif
+        return false;
+    }
+
+#if A2ALLOC_LOCK_STATS
+    unsigned long start = lock_clock();
+#endif
+#if A2ALLOC_LOCK == LOCK_TICKET
+    unsigned int spins = 0;
+    while ((serving = __atomic_load_n(&lock->serving, __ATOMIC_ACQUIRE)) != ticket) {
+        // only the next in line can get it on the next release
+        if (ticket - serving == 1 && spins++ < LOCK_SPINS) {
+            lock_pause();
+            continue;
+        }
+        // seq_cst pairs with lock_release: either it sees us parked, or
+        // we see serving move on and the futex doesn't sleep
+        __atomic_add_fetch(&lock->parked, 1, __ATOMIC_SEQ_CST);
+        serving = __atomic_load_n(&lock->serving, __ATOMIC_SEQ_CST);
+        if (serving != ticket) {
+            syscall(SYS_futex, &lock->serving, FUTEX_WAIT_PRIVATE, serving, NULL, NULL, 0);
+        }
+        __atomic_sub_fetch(&lock->parked, 1, __ATOMIC_RELAXED);
+    }
+#else
+    pthread_mutex_lock(&lock->mutex);
+#endif
+#if A2ALLOC_LOCK_STATS
+    lock->acquired++;
+    lock->contended++;
+    lock->wait_cycles += lock_clock() - start;
+#endif
+    return true;
+}
+
+void lock_release(struct alloc_lock * lock)
+{
+#if A2ALLOC_LOCK == LOCK_TICKET
+    __atomic_add_fetch(&lock->serving, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&lock->parked, __ATOMIC_SEQ_CST) != 0) {
+        syscall(SYS_futex, &lock->serving, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+    }
+#else
+    pthread_mutex_unlock(&lock->mutex);
+#endif
+}
+
 
 /**
  * A node in the freelist linked list
@@ -76,44 +418,280 @@ struct freelist_node* make_freelist_node (void * begin) {
  * A superblock is the base unit of the allocator
  * They are all of the same size
  * All superblocks in a sequence have the same segment size
+ *
+ * While it's in use, heap_idx only changes while the owning heap's lock for
+ * its size class is held, so a thread holding that lock can trust it.
+ * Segments freed by threads that don't own the superblock go on
+ * remote_freelist, which is pushed to with a CAS and only ever emptied as a
+ * whole by the owner; free_count doesn't include them until then. The first
+ * remote free also puts the superblock on its heap's remote_sbs stack for its
+ * class (remote_queued says it's there), so the owner can find it without
+ * looking at every superblock. reclaimed is cleared last, with a release
+ * store, when a superblock is put back in use, so whoever sees it clear also
+ * sees the superblock's new class.
+ *
+ * With SB_TRACK_FREELIST, segments are carved lazily: the free ones are those
+ * on freelist plus every segment from index bump to the end of the
+ * superblock, which has never been handed out.
+ * With SB_TRACK_BITMAP, bit i of free_map is set when the i-th segment of the
+ * superblock (counting the ones taken by this header) is free.
+ *
+ * A superblock spans sb_size bytes, one of the sizes in SEG_SB_SIZES, and
+ * isn't aligned to it; get_sb finds the header through the page map.
  */
 struct superblock {
     unsigned int free_count;
     unsigned int seg_size;
+    unsigned int sb_size;
     unsigned int heap_idx;
     unsigned int max_segs;
+#if SB_FREE_TRACKING == SB_TRACK_FREELIST
     struct freelist_node * freelist;
+    unsigned int bump;
+#endif
+    struct freelist_node * remote_freelist;
+    struct superblock* remote_next;
     struct superblock* next;
     struct superblock* prev;
+    unsigned int bin;
     bool reclaimed;
+    bool remote_queued;
+#if SB_FREE_TRACKING == SB_TRACK_BITMAP
+    unsigned long free_map[SB_BITMAP_WORDS];
+#endif
 };
 
+/**
+ * Header of a block too big for any superblock, spanning `size` superblocks
+ * Aligned so that the memory handed out right after it is 16-byte aligned
+ */
 struct largeblock {
     unsigned int size;
-    struct largeblock* next;
-    struct largeblock* prev;
-};
+} __attribute__((aligned(16)));
 
+/**
+ * A heap's state for one size class, on cache lines of its own so threads
+ * working on different classes, or on different heaps, never share a line
+ */
+struct heap_class {
+    // guards bins and the superblocks in them
+    struct alloc_lock lock;
+    // superblocks in use, by fullness bin (see sb_fullness_bin)
+    struct superblock* bins[SB_NUM_BINS];
+    // acquisitions of lock that had to wait
+    unsigned long lock_waits;
+} __attribute__((aligned(64)));
+
+/**
+ * Heaps sit next to each other in one array, so everything that gets
+ * written starts a cache line of its own: the classes, what other heaps'
+ * threads write to, the heap-wide lock and lists, and the counters. What's
+ * left is rarely written and shares the last line.
+ */
 struct sb_heap {
-    struct superblock* sb_map[NUM_SEGS];
-    struct superblock* sb_freelist;
-    pthread_mutex_t heap_lock;
-    unsigned int cur_f;
+    struct heap_class classes[NUM_SEGS];
+
+    // superblocks with remote frees by class, linked through remote_next;
+    // pushed to with a CAS by anyone, taken as a whole by the class lock holder
+    struct superblock* remote_sbs[NUM_SEGS] __attribute__((aligned(64)));
+
+    // heap_lock only guards sb_freelist, and is never held while taking a
+    // class lock
+    struct alloc_lock heap_lock __attribute__((aligned(64)));
+    // reclaimed superblocks, by get_sb_size_index (heap 0 uses global_sb_stack)
+    struct superblock* sb_freelist[NUM_SB_SIZES];
+
+    // what's left of the heap's current chunk, which new superblocks and
+    // large blocks are cut from with a CAS on chunk_next (see heap_cut);
+    // grow_lock guards refilling it and the region the heap grows in, and
+    // is taken before span_lock
+    void * chunk_next __attribute__((aligned(64)));
+    void * chunk_end;
+    struct alloc_lock grow_lock;
+
+    // segments handed out, segments and superblocks owned; updated with
+    // atomics, since no one lock covers all classes
+    unsigned int cur_f __attribute__((aligned(64)));
     unsigned int total_f;
     unsigned int cur_k;
-};
+    // refills and flushes so far
+    unsigned long ops;
+
+    // how many refills and flushes there had been at the last idle heap
+    // scan (see fold_idle_heaps)
+    unsigned long ops_at_scan __attribute__((aligned(64)));
+    // which of llc_heaps is next up from this heap
+    unsigned int llc_idx;
+    // threads that picked or were bound to this heap
+    unsigned int threads;
+    // the region the heap grows in, NULL until it first grows; grow_lock
+    // guards it
+    struct region * region;
+} __attribute__((aligned(64)));
 
-// TOP - 1 is the largest allocated address
-static void * TOP = NULL;
-// BOTTOM is the lowest address of any superblock
-static void * BOTTOM = NULL;
+/**
+ * Per-thread stack of free segments for one size class
+ * Only ever touched by its own thread, so it needs no locks and no atomics
+ * With SB_TRACK_BITMAP nothing else writes into free segments, so the bin
+ * keeps them in an array rather than linking them through their first word,
+ * and freeing a segment doesn't touch its (likely cold) line
+ */
+struct tcache_bin {
+#if SB_FREE_TRACKING == SB_TRACK_BITMAP
+    void * slots[TCACHE_MAX_COUNT];
+#else
+    struct freelist_node * head;
+#endif
+    unsigned int count;
+};
 
 // indices in SEG_SIZES
-static struct largeblock* large_list;
-static pthread_mutex_t large_lock;
-static pthread_mutex_t sbrk_lock;
 static struct sb_heap* heap;
+// how many superblocks were stolen instead of made (see steal_superblock);
+// any heap may bump it, so it gets a line to itself
+static unsigned long sb_steals __attribute__((aligned(64))) = 0;
+
+static __thread struct tcache_bin tcache[NUM_SEGS];
+#if SB_FREE_TRACKING == SB_TRACK_BITMAP
+// how many segments in this thread's bins hash to each slot (see
+// tcache_mark), so that checking a free for a double free only has to scan
+// its bin when the slot is taken
+#define TCACHE_MARK_BITS    12
+static __thread unsigned short tcache_marks[1 << TCACHE_MARK_BITS];
+#endif
+static __thread bool tcache_registered = false;
+// the thread's heap under HEAP_POLICY_THREAD or a2alloc_bind_heap, 0 until it has one
+static __thread unsigned int thread_heap = 0;
+static __thread bool thread_heap_bound = false;
+// class lock acquisitions in the current rebalancing window, and how many waited
+static __thread unsigned int thread_lock_count = 0;
+static __thread unsigned int thread_lock_waits = 0;
+// used only for its destructor, which flushes a thread's cache when it exits
+static pthread_key_t tcache_key;
+void tcache_destroy(void * unused);
+unsigned int get_heap_index();
+void heap_flush_bin(const unsigned int seg_size_idx, struct tcache_bin * bin, unsigned int count);
+unsigned int heap_drain_remote(const unsigned int heap_idx, const unsigned int seg_size_idx);
+unsigned int heap_give_reclaimed(const int heap_idx, const unsigned int max, const unsigned int keep_k, const bool to_global);
+unsigned int global_sb_release(void);
+#if A2ALLOC_RSEQ
+void cpu_caches_init(const unsigned int cpu_count);
+#endif
+
+//////////////////////////////////// PAGE MAP ////////////////////////////////////
+// The page map records, for every page the allocator hands out, what kind of
+// block lives there, its header and its size class. It is a three-level radix
+// tree over the page number of the address, so lookups are O(1) for any
+// pointer without needing the heap to be contiguous.
+// Interior nodes are created on demand and never freed; they are published
+// with a release store so lookups need no lock.
+
+#define PAGE_SHIFT          12
+#define PAGEMAP_LEVEL_BITS  12
+#define PAGEMAP_FANOUT      (1UL << PAGEMAP_LEVEL_BITS)
+#define PAGEMAP_MASK        (PAGEMAP_FANOUT - 1)
+
+// what a page is being used for
+#define PAGE_UNUSED         0
+#define PAGE_SMALL          1
+#define PAGE_LARGE          2
+#define PAGE_SPAN           3   // first or last page of a free span
+#define PAGE_HUGE           4   // first page of a block mapped on its own
+
+struct page_info {
+    void * hdr;                 // struct superblock *, struct largeblock * or struct span *
+    unsigned char kind;
+    unsigned char seg_idx;      // index in SEG_SIZES, PAGE_SMALL only
+};
+
+struct pagemap_leaf {
+    struct page_info pages[PAGEMAP_FANOUT];
+};
+
+struct pagemap_node {
+    struct pagemap_leaf * leaves[PAGEMAP_FANOUT];
+};
+
+static struct pagemap_node * pagemap[PAGEMAP_FANOUT];
+static struct alloc_lock pagemap_lock = ALLOC_LOCK_INITIALIZER;
+
+/**
+ * Get zeroed memory for the page map straight from the OS, so that it
+ * doesn't come out of the heaps' regions
+ */
+void * pagemap_alloc(const size_t size)
+{
+    void * mem = mem_map(size);
+    if (mem == NULL) {
+        fprintf(stderr, "[pagemap_alloc] mmap failed, ran out of memory\n");
+        return NULL;
+    }
+    return mem;
+}
+
+/**
+ * Return the page map entry for the given address, or NULL if nothing was ever
+ * recorded near it. With create set, build any missing nodes on the way.
+ */
+struct page_info * pagemap_entry(const void * addr, const bool create)
+{
+    unsigned long page = (unsigned long) addr >> PAGE_SHIFT;
+    unsigned long i1 = (page >> (2 * PAGEMAP_LEVEL_BITS)) & PAGEMAP_MASK;
+    unsigned long i2 = (page >> PAGEMAP_LEVEL_BITS) & PAGEMAP_MASK;
+    unsigned long i3 = page & PAGEMAP_MASK;
+
+    struct pagemap_node * node = __atomic_load_n(&pagemap[i1], __ATOMIC_ACQUIRE);
+    struct pagemap_leaf * leaf = node ? __atomic_load_n(&node->leaves[i2], __ATOMIC_ACQUIRE) : NULL;
+
+    if (leaf == NULL) {
+        if (!create) return NULL;
+
+        lock_acquire(&pagemap_lock);
+        if ((node = pagemap[i1]) == NULL) {
+            node = pagemap_alloc(sizeof (struct pagemap_node));
+            __atomic_store_n(&pagemap[i1], node, __ATOMIC_RELEASE);
+        }
+        if (node != NULL && (leaf = node->leaves[i2]) == NULL) {
+            leaf = pagemap_alloc(sizeof (struct pagemap_leaf));
+            __atomic_store_n(&node->leaves[i2], leaf, __ATOMIC_RELEASE);
+        }
+        lock_release(&pagemap_lock);
+
+        if (leaf == NULL) return NULL;
+    }
+
+    return &leaf->pages[i3];
+}
+
+/**
+ * Record that the `size` bytes starting at begin (page-aligned) belong to the
+ * block with header hdr
+ */
+void pagemap_set(void * begin, const unsigned long size, const unsigned char kind,
+                 void * hdr, const unsigned int seg_idx)
+{
+    DEBUG(DB_PAGEMAP, "[pagemap_set] %p + %lu -> kind %u, header %p, class %u\n", begin, size, kind, hdr, seg_idx);
+    assert((unsigned long) begin % (1UL << PAGE_SHIFT) == 0);
+
+    unsigned long off;
+    for (off = 0; off < size; off += 1UL << PAGE_SHIFT) {
+        struct page_info * info = pagemap_entry(begin + off, true);
+        assert(info != NULL);
+        info->hdr = hdr;
+        info->kind = kind;
+        info->seg_idx = seg_idx;
+    }
+}
 
+/**
+ * Return the page map entry for addr, or NULL if the allocator doesn't own it
+ */
+struct page_info * pagemap_lookup(const void * addr)
+{
+    struct page_info * info = pagemap_entry(addr, false);
+    if (info == NULL || info->kind == PAGE_UNUSED) return NULL;
+    return info;
+}
 
 /**
  * Given an address, return the pointer to the containing superblock
@@ -121,26 +699,67 @@ static struct sb_heap* heap;
 struct superblock * get_sb(void * addr) {
     DEBUG(DB_GET_SB, "[get_sb] Finding address of superblock for address %p\n", addr);
 
-    unsigned int sb_idx = (addr - BOTTOM) / SB_SIZE;
-    DEBUG(DB_GET_SB, "[get_sb] Index of superblock is %u\n", sb_idx);
+    struct page_info * info = pagemap_lookup(addr);
+    assert(info != NULL && info->kind == PAGE_SMALL);
 
-    return ((struct superblock *) (BOTTOM + sb_idx * SB_SIZE));
+    return (struct superblock *) info->hdr;
 }
 
 /**
- * Given segment size, return index in array SEG_SIZES
+ * Fill in SEG_SIZES and the size -> class lookup table
  */
-unsigned int get_seg_index (const unsigned int seg_size)
+void init_size_classes(void)
 {
-    /*printf("%u -> %u\n", seg_size, __builtin_clz(seg_size));*/
-    // 27 = 32 - 5, where 32 is the size of unsigned int
-    /*return 27 - __builtin_clz(seg_size);*/
-    unsigned int i;
+    unsigned int n = 0;
+    unsigned int seg_size = MIN_SEG;
+
+    while (seg_size <= MAX_SEG) {
+        assert(n < NUM_SEGS);
+        SEG_SIZES[n++] = seg_size;
+
+        // a quarter of the power of two at or below seg_size
+        unsigned int step = (1U << (31 - __builtin_clz(seg_size))) / 4;
+        seg_size += step < SEG_ALIGN ? SEG_ALIGN : step;
+    }
+    // NUM_SEGS has to agree with the spacing rules above
+    assert(n == NUM_SEGS);
+    assert(SEG_SIZES[NUM_SEGS - 1] == MAX_SEG);
+
+    unsigned int i, seg_idx = 0;
+    for (i = 0; i <= MAX_SEG / SEG_ALIGN; i++) {
+        while (SEG_SIZES[seg_idx] < i * SEG_ALIGN) seg_idx++;
+        size_to_seg_idx[i] = seg_idx;
+    }
+
     for (i = 0; i < NUM_SEGS; i++) {
-        if (SEG_SIZES[i] == seg_size) return i;
+        unsigned int sb_size = SB_BYTES;
+        while (sb_size < SB_MIN_SEGS * SEG_SIZES[i] && sb_size < SB_MAX_SIZE)
+            sb_size <<= 1;
+        SEG_SB_SIZES[i] = sb_size;
+        SEG_RECIPS[i] = ((1UL << 32) + SEG_SIZES[i] - 1) / SEG_SIZES[i];
+        // the bitmap is sized for the smallest class in the smallest superblock
+        assert(sb_size / SEG_SIZES[i] <= SB_BITMAP_WORDS * 64);
     }
-    assert(false); // should never get here
-    return 0; // to suppress compiler warning
+}
+
+/**
+ * Index into sb_heap.sb_freelist for superblocks of the given size
+ */
+unsigned int get_sb_size_index(const unsigned int sb_size)
+{
+    assert(sb_size >= SB_BYTES && sb_size <= SB_MAX_SIZE);
+    return __builtin_ctz(sb_size / SB_BYTES);
+}
+
+/**
+ * Given segment size, return index in array SEG_SIZES
+ */
+unsigned int get_seg_index (const unsigned int seg_size)
+{
+    assert(seg_size <= MAX_SEG && seg_size % SEG_ALIGN == 0);
+    unsigned int seg_idx = size_to_seg_idx[seg_size / SEG_ALIGN];
+    assert(SEG_SIZES[seg_idx] == seg_size); // should always be an exact class
+    return seg_idx;
 }
 
 /**
@@ -151,18 +770,37 @@ int get_sb_header_seg_size(struct superblock * sb)
     return (sizeof (struct superblock) / sb->seg_size) + 1;
 }
 
+#if SB_FREE_TRACKING == SB_TRACK_BITMAP
+/**
+ * Set bits [from, to) of a superblock's free_map and clear all the others
+ */
+void bitmap_set_range(unsigned long * map, unsigned int from, unsigned int to)
+{
+    unsigned int w;
+    for (w = 0; w < SB_BITMAP_WORDS; w++) {
+        unsigned int lo = w * 64, hi = lo + 64;
+        unsigned long word = ~0UL;
+        if (from >= hi || to <= lo) {
+            word = 0;
+        } else {
+            if (from > lo) word &= ~0UL << (from - lo);
+            if (to < hi) word &= ~(~0UL << (to - lo));
+        }
+        map[w] = word;
+    }
+}
+#endif
+
 void clear_superblock (struct superblock* sb, unsigned int segment_size)
 {
     DEBUG(DB_CLEAR_SUPERBLOCK, "[clear_superblock] Clearing SB at address %p\n", sb);
     DEBUG(DB_CLEAR_SUPERBLOCK, "[clear_superblock] Size of superblock struct is %lu\n",
           sizeof (struct superblock));
 
-    struct freelist_node* fl_node;
     sb->free_count = 0;
-    DEBUG(DB_CLEAR_SUPERBLOCK, "[clear_superblock] Setting reclaimed = false\n");
-    sb->reclaimed = false;
 
-    sb->freelist = NULL;
+    sb->remote_freelist = NULL;
+    sb->bin = 0;
     /*if (sb->seg_size != 0) {*/
     /*free all the nodes in the superblock's freelist*/
     /*DEBUG(DB_CLEAR_SUPERBLOCK, "[clear_superblock] Deleting old superblock freelist\n");*/
@@ -170,512 +808,2204 @@ void clear_superblock (struct superblock* sb, unsigned int segment_size)
 
     DEBUG(DB_CLEAR_SUPERBLOCK, "[clear_superblock] Setting seg_size = %u\n", segment_size);
     sb->seg_size = segment_size;
-
-    DEBUG(DB_CLEAR_SUPERBLOCK, "[clear_superblock] Creating superblock freelist\n");
-    // used to update next pointers
-    struct freelist_node* prev = NULL;
+    pagemap_set(sb, sb->sb_size, PAGE_SMALL, sb, get_seg_index(segment_size));
 
     // determine how many segments the superblock struct occupies
     int sb_offset = get_sb_header_seg_size(sb);
     DEBUG(DB_CLEAR_SUPERBLOCK, "[clear_superblock] Using %d segments for header data\n", sb_offset);
 
-    int max_segs = SB_SIZE / segment_size;
+    int max_segs = sb->sb_size / segment_size;
     DEBUG(DB_CLEAR_SUPERBLOCK, "[clear_superblock] There should be %d segments in freelist\n", max_segs - sb_offset);
     //max_segs = max_segs - SB_SIZE / segment_size / 64;
     DEBUG(DB_CLEAR_SUPERBLOCK, "[clear_superblock] There should actually be %d segments in freelist\n", max_segs - sb_offset);
     sb->max_segs = max_segs - sb_offset;
     // the first segment is reserved for superblock struct
-    int i;
-    for (i = sb_offset; i < max_segs; i++) {
-        void * node_addr = ((void *) sb) + ((unsigned long) i * segment_size);
-        DEBUG(DB_CLEAR_SUPERBLOCK, "[clear_superblock] Created freelist node at address %p with segment size %u\n", node_addr, segment_size);
-        fl_node = make_freelist_node(node_addr);
-        sb->free_count++;
-        DEBUG(DB_CLEAR_SUPERBLOCK, "[clear_superblock] Adding freelist node to freelist\n");
-        if (sb->freelist == NULL)
-            sb->freelist = fl_node;
-        if (prev)
-            prev->next = fl_node;
-        prev = fl_node;
-    }
+#if SB_FREE_TRACKING == SB_TRACK_BITMAP
+    assert(max_segs <= SB_BITMAP_WORDS * 64);
+    bitmap_set_range(sb->free_map, sb_offset, max_segs);
+    sb->free_count = sb->max_segs;
+#else
+    // nothing is carved yet, sb_freelist_pop hands segments out from bump
+    sb->freelist = NULL;
+    sb->bump = sb_offset;
+    sb->free_count = sb->max_segs;
+#endif
 
     DEBUG(DB_CLEAR_SUPERBLOCK, "[clear_superblock] free_count=%u\n", sb->free_count);
+    DEBUG(DB_CLEAR_SUPERBLOCK, "[clear_superblock] Setting reclaimed = false\n");
+    __atomic_store_n(&sb->reclaimed, false, __ATOMIC_RELEASE);
 }
 
-struct superblock * make_superblock(const int segment_size) {
-    pthread_mutex_lock(&sbrk_lock);
-    void * begin = TOP;
-    assert(segment_size > 0);
-    assert(begin != NULL);
+////////////////////////////////// REGIONS //////////////////////////////////
+// Superblocks and large blocks are carved out of regions: REGION_SIZE bytes
+// of address space aligned to REGION_SIZE and mapped on their own (see
+// mem_region_map), so the region of a block is its address with the low bits
+// masked off. A region's first page holds its header. Each heap grows in a
+// region of its own, and maps a new one when that is full, so the blocks a
+// heap makes stay close together. A full region whose memory has all come
+// back as one free span is unmapped.
+// Heaps take HEAP_CHUNK_SIZE bytes of their region at a time and cut their
+// superblocks and large blocks out of that chunk without a lock, so threads
+// refilling different heaps, or different classes of one heap, don't queue
+// behind each other.
+
+#define REGION_SHIFT        26
+#define REGION_SIZE         (1UL << REGION_SHIFT)
+#define REGION_HDR_SIZE     SB_SIZE
+// the largest block a region can hold; bigger ones are mapped on their own
+#define REGION_BLOCK_MAX    (REGION_SIZE - REGION_HDR_SIZE)
+// how much of its region a heap takes at a time; blocks bigger than this
+// come straight from the region
+#define HEAP_CHUNK_SIZE     (256 * 1024)
+
+struct region {
+    struct mem_region mem;
+    // set once no heap grows in the region any more, under span_lock
+    bool full;
+};
 
-    DEBUG(DB_MAKE_SUPERBLOCK, "[make_superblock] Trying to increase TOP by %lu\n", SB_SIZE);
-    void * addr = mem_sbrk(SB_SIZE);
+static unsigned long regions_mapped = 0;
 
-    if (TOP != NULL && addr == NULL) {
-        fprintf(stderr, "[make_superblock] mem_sbrk failed, ran out of memory\n");
-        pthread_mutex_unlock(&sbrk_lock);
-        return NULL;
-    } else {
-        TOP += SB_SIZE;
+/**
+ * The region the given block address is in
+ */
+struct region * region_of(const void * addr)
+{
+    return (struct region *) ((unsigned long) addr & ~(REGION_SIZE - 1));
+}
 
-        if (BOTTOM == NULL) {
-            BOTTOM = addr;
-            DEBUG(DB_MAKE_SUPERBLOCK, "[make_superblock] This is the very first superblock. Setting BOTTOM = %p\n", BOTTOM);
-            DEBUG(DB_MAKE_SUPERBLOCK, "[make_superblock] Amount of space used by the rest of our allocator is then %lu\n", BOTTOM - (void *) dseg_lo);
-        }
+/**
+ * Whether addr lies in the part of its region handed out so far
+ */
+bool region_holds(const void * addr)
+{
+    struct region * r = region_of(addr);
+    return addr >= (void *) r + REGION_HDR_SIZE &&
+           addr <= (void *) __atomic_load_n(&r->mem.hi, __ATOMIC_RELAXED);
+}
 
-        DEBUG(DB_MAKE_SUPERBLOCK, "[make_superblock] Success! Top now at %p\n", TOP);
-        // clear out any crap that might be in here from before
-        bzero(begin, SB_SIZE);
+/**
+ * Map a new region, with its header in its first page
+ */
+struct region * region_map(void)
+{
+    struct mem_region mem;
+    if (mem_region_map(&mem, REGION_SIZE) != 0) {
+        fprintf(stderr, "[region_map] mmap failed, ran out of address space\n");
+        return NULL;
     }
-    pthread_mutex_unlock(&sbrk_lock);
-
-    // keep all superblock information in first segment of superblock
-    struct superblock* sb = (struct superblock *) begin;
-    DEBUG(DB_MAKE_SUPERBLOCK, "[make_superblock] Creating new SB at address %p with segment size %u\n", begin, segment_size);
 
-    sb->seg_size = 0; // clear superblock needs this to check if this is a newly reclaimed guy
-    sb->freelist = NULL;
-    sb->next = NULL;
-    sb->prev = NULL;
-    sb->reclaimed = false;
+    struct region * r = mem_region_sbrk(&mem, REGION_HDR_SIZE);
+    if (r == NULL) {
+        fprintf(stderr, "[region_map] couldn't commit the region header, ran out of memory\n");
+        mem_region_unmap(&mem);
+        return NULL;
+    }
+    assert((void *) r == (void *) mem.lo);
+    r->mem = mem;
+    r->full = false;
 
-    clear_superblock(sb, segment_size);
-    return sb;
+    __atomic_add_fetch(&regions_mapped, 1, __ATOMIC_RELAXED);
+    DEBUG(DB_MAKE_SUPERBLOCK, "[region_map] New region at %p\n", r);
+    return r;
 }
 
-//large blocks for allocation > SB_SIZE/2
-struct largeblock * make_largeblock(void * begin, const int allocation_size) {
-    pthread_mutex_lock(&sbrk_lock);
-    int target_alloc = (((allocation_size + sizeof(struct largeblock))/SB_SIZE + 1) * SB_SIZE);
-    assert(target_alloc > 0);
-    assert(target_alloc % SB_SIZE == 0);
-    DEBUG(DB_MAKE_SUPERBLOCK, "[make_largeblock] Target allocation is %d\n", target_alloc);
-    void * addr = mem_sbrk(target_alloc);
+/**
+ * How many regions are mapped right now
+ */
+unsigned long a2alloc_regions(void)
+{
+    return __atomic_load_n(&regions_mapped, __ATOMIC_RELAXED);
+}
 
-    if (TOP != NULL && addr == NULL) {
-        fprintf(stderr, "[make_largeblock] mem_sbrk failed, ran out of memory\n");
-        pthread_mutex_unlock(&sbrk_lock);
-        return NULL;
-    } else {
-        TOP += target_alloc;
+/////////////////////////////////// SPANS ///////////////////////////////////
+// Freed large blocks become free spans: runs of whole SB_SIZE pages, kept in
+// lists by length under span_lock (span_lists[n] holds the spans of n pages,
+// the last list every longer one). A freed span is merged with the free
+// spans right before and after it, which it finds through the page map: the
+// first and last page of a free span are recorded as PAGE_SPAN, pointing at
+// its header. Large blocks are carved out of free spans before the heap
+// grows, and so are superblocks once there's no reclaimed one anywhere, so
+// span memory only turns into superblocks when small classes need it.
+
+#define SPAN_LISTS          64
+
+struct span {
+    unsigned long pages;
+    struct span * next;
+    struct span * prev;
+};
 
-        if (BOTTOM == NULL) {
-            BOTTOM = begin;
-        }
+static struct span * span_lists[SPAN_LISTS];
+static unsigned long span_pages_free = 0;
+static struct alloc_lock span_lock = ALLOC_LOCK_INITIALIZER;
 
-        DEBUG(DB_MAKE_SUPERBLOCK, "[make_largeblock] Success! Top now at %p\n", TOP);
-    }
-    pthread_mutex_unlock(&sbrk_lock);
-    DEBUG(DB_MAKE_SUPERBLOCK, "[make_largeblock] Creating largeblock at address %p spanning %lu superblocks\n", begin, target_alloc / SB_SIZE);
+unsigned int span_list_index(const unsigned long pages)
+{
+    return pages < SPAN_LISTS ? pages : SPAN_LISTS - 1;
+}
 
-    struct largeblock* lb = (struct largeblock *) begin;
-    lb->size = target_alloc/SB_SIZE;
-    DEBUG(DB_MAKE_SUPERBLOCK, "[make_largeblock] Creating largeblock size is %d superblocks\n", lb->size);
-    lb->next = NULL;
-    lb->prev = NULL;
+/**
+ * Turn the given pages into a free span, without merging
+ * Must be called with span_lock held
+ */
+void span_insert(void * begin, const unsigned long pages)
+{
+    struct span * span = (struct span *) begin;
+    struct span ** head = &span_lists[span_list_index(pages)];
+
+    span->pages = pages;
+    span->prev = NULL;
+    span->next = *head;
+    if (*head != NULL) (*head)->prev = span;
+    *head = span;
+    span_pages_free += pages;
+
+    pagemap_set(begin, SB_SIZE, PAGE_SPAN, span, 0);
+    pagemap_set(begin + (pages - 1) * SB_SIZE, SB_SIZE, PAGE_SPAN, span, 0);
+}
 
-    //inserting into large list
-    if (large_list == NULL) {
-        DEBUG(DB_MAKE_SUPERBLOCK, "[make_largeblock] This is the first largeblock\n");
-        large_list = lb;
-    } else {
-        DEBUG(DB_MAKE_SUPERBLOCK, "[make_largeblock] Adding newly created largeblock to front of large_list\n");
-        struct largeblock * old_head = large_list;
-        DEBUG(DB_MAKE_SUPERBLOCK, "[make_largeblock] before: old head next is: %p, prev is: %p\n", old_head->next, old_head->prev);
-        lb->next = old_head;
-        old_head->prev = lb;
-        DEBUG(DB_MAKE_SUPERBLOCK, "[make_largeblock] after: old head next is: %p, prev is: %p\n", old_head->next, old_head->prev);
-        large_list = lb;
-        DEBUG(DB_MAKE_SUPERBLOCK, "[make_largeblock] after: large_list next is: %p, prev is: %p\n", large_list->next, large_list->prev);
-    }
-    return lb;
+/**
+ * Take a free span off its list; its pages are no longer a free span
+ * Must be called with span_lock held
+ */
+void span_remove(struct span * span)
+{
+    if (span->prev) span->prev->next = span->next;
+    else span_lists[span_list_index(span->pages)] = span->next;
+    if (span->next) span->next->prev = span->prev;
+    span_pages_free -= span->pages;
+
+    // so a neighbour being freed doesn't take it for a free span any more
+    pagemap_set(span, SB_SIZE, PAGE_UNUSED, NULL, 0);
+    pagemap_set((void *) span + (span->pages - 1) * SB_SIZE, SB_SIZE, PAGE_UNUSED, NULL, 0);
 }
 
 /**
- * Return address of the large block corresponding to the given address in large_list if found
- * Return NULL on failure
+ * The free span whose first or last page is the given page, or NULL
+ * Must be called with span_lock held
  */
-struct largeblock * find_in_large_list(void * addr) {
-    DEBUG(DB_LARGELIST, "[find_largeblock] searching for large block if exists\n");
+struct span * span_at(const void * page)
+{
+    struct page_info * info = pagemap_lookup(page);
+    if (info == NULL || info->kind != PAGE_SPAN) return NULL;
+    return (struct span *) info->hdr;
+}
 
-    struct largeblock * cur_lb;
-    for (cur_lb = large_list; cur_lb != NULL; cur_lb = cur_lb->next) {
-        if ((void *)cur_lb + sizeof(struct largeblock) == addr) {
-            DEBUG(DB_LARGELIST, "[find_largeblock] Found matching large block at address %p\n", cur_lb);
-            return cur_lb;
-        }
+/**
+ * Unmap the given region if it's full and its memory is all one free span
+ * Must be called with span_lock held
+ */
+void region_release_if_free(struct region * r)
+{
+    struct span * span = span_at((void *) r + REGION_HDR_SIZE);
+    if (!r->full || span == NULL ||
+            (void *) span + span->pages * SB_SIZE != (void *) r->mem.hi + 1) {
+        return;
     }
 
-    DEBUG(DB_LARGELIST, "[find_largeblock] Did not find address %p in large_list\n", addr);
-    return NULL;
+    span_remove(span);
+    // forget what was in the region before the address can be mapped again
+    pagemap_set(span, span->pages * SB_SIZE, PAGE_UNUSED, NULL, 0);
+
+    struct mem_region mem = r->mem;
+    DEBUG(DB_LARGELIST, "[region_release_if_free] Unmapping region at %p\n", r);
+    if (mem_region_unmap(&mem) != 0) {
+        fprintf(stderr, "[region_release_if_free] munmap of region %p failed\n", mem.lo);
+    }
+    __atomic_sub_fetch(&regions_mapped, 1, __ATOMIC_RELAXED);
 }
 
 /**
- * Add an element to the front of the sb freelist
+ * Give the given pages back as a free span, merged with the free spans
+ * next to it
  */
-void sb_freelist_push (struct superblock * sb, struct freelist_node * fl_node)
+void span_free(void * begin, unsigned long pages)
 {
-    assert(sb != NULL);
-    assert(fl_node != NULL);
+    lock_acquire(&span_lock);
+    struct span * after = span_at(begin + pages * SB_SIZE);
+    struct span * before = span_at(begin - SB_SIZE);
 
-    fl_node->next = sb->freelist;
-    sb->freelist = fl_node;
-    sb->free_count++;
+    if (after != NULL) {
+        span_remove(after);
+        pages += after->pages;
+    }
+    if (before != NULL) {
+        span_remove(before);
+        pages += before->pages;
+        begin = before;
+    }
+    DEBUG(DB_LARGELIST, "[span_free] Free span of %lu pages at %p\n", pages, begin);
+    span_insert(begin, pages);
+    region_release_if_free(region_of(begin));
+    lock_release(&span_lock);
 }
 
 /**
- * Remove and return the first freelist node in the sb's freelist
+ * Carve the given number of pages out of a free span: one of exactly that
+ * length if there is one, otherwise the front of the first longer one
+ * Return NULL if no free span is long enough
  */
-struct freelist_node * sb_freelist_pop (struct superblock * sb) {
-    assert(sb != NULL);
-    assert(sb->free_count > 0);
-    assert(sb->freelist != NULL);
-
-    DEBUG(DB_MALLOC, "[sb_freelist_pop] next is pointing to: %p\n", sb->freelist->next);
-    struct freelist_node * node = sb->freelist;
-
-    sb->freelist = sb->freelist->next;
-    sb->free_count--;
+void * span_alloc(const unsigned long pages)
+{
+    struct span * span = NULL;
+    unsigned int i;
 
-    // the freelist should be not null whenever free_count != 0
-    assert(sb->free_count == 0 || sb->freelist != NULL);
+    if (__atomic_load_n(&span_pages_free, __ATOMIC_RELAXED) < pages) return NULL;
 
-    DEBUG(DB_MALLOC, "[sb_freelist_pop] New free_count of SB is %u\n", sb->free_count);
-    return node;
+    lock_acquire(&span_lock);
+    for (i = span_list_index(pages); i < SPAN_LISTS && span == NULL; i++) {
+        for (span = span_lists[i]; span != NULL && span->pages < pages; span = span->next);
+    }
+    if (span != NULL) {
+        unsigned long left = span->pages - pages;
+        span_remove(span);
+        if (left > 0) {
+            span_insert((void *) span + pages * SB_SIZE, left);
+        }
+        DEBUG(DB_LARGELIST, "[span_alloc] Took %lu pages at %p from a free span\n", pages, span);
+    }
+    lock_release(&span_lock);
+    return span;
 }
 
 /**
- * Reclaim the given superblock
- * + Remove from chain of blocks with same segsize
- * + Set reclaimed = true
+ * Turn the reclaimed superblocks of heap 0 and the LLC heaps into free
+ * spans, which unmaps any region that leaves wholly free, then give the
+ * pages of every free span back to the OS, all but the first, which holds
+ * the span's header. The spans stay free and are reused as before, the
+ * pages just come back zeroed. Return how many bytes of free spans that
+ * covered
  */
-void reclaim_superblock (struct superblock * sb, const int src_idx, const int dest_idx)
+unsigned long a2alloc_trim(void)
 {
-    assert(sb != NULL);
-    assert(sb->free_count == sb->max_segs);
+    unsigned long bytes = 0;
+    struct span * span;
+    unsigned int i;
 
-    if (sb->prev) sb->prev->next = sb->next;
-    if (sb->next) sb->next->prev = sb->prev;
-    int heap_idx = dest_idx;
+    unsigned int released = global_sb_release();
+    DEBUG(DB_LARGELIST, "[a2alloc_trim] Heap 0 gave %u superblocks back as free spans\n", released);
 
-    // update first pointer to linked list, if I was the first
-    if (sb->prev == NULL) {
-        unsigned int seg_idx = get_seg_index(sb->seg_size);
-        //reclaim comes from sb_map, freelist, and free_large
-        if (heap[src_idx].sb_map[seg_idx] == sb) { //check if it came from free_large
-            heap[src_idx].sb_map[seg_idx] = sb->next;
-        } else if (heap[src_idx].sb_freelist == sb ) {
-            heap[src_idx].sb_freelist = sb->next;
+    lock_acquire(&span_lock);
+    for (i = 0; i < SPAN_LISTS; i++) {
+        for (span = span_lists[i]; span != NULL; span = span->next) {
+            if (span->pages > 1 &&
+                mem_decommit((void *) span + SB_SIZE, (span->pages - 1) * SB_SIZE) == 0) {
+                bytes += (span->pages - 1) * SB_SIZE;
+            }
         }
     }
-    sb->reclaimed = true;
-    sb->heap_idx = dest_idx;
-
-    // add to list of reclaimed superblocks
-    DEBUG(DB_FREE, "[mm_free] first element of freelist is %p\n", heap[heap_idx].sb_freelist);
-    if (heap[heap_idx].sb_freelist == NULL) {
-        // first reclaimed superblock
-        DEBUG(DB_FREE, "[mm_free] This is the first reclaimed superblock for heap %d\n", heap_idx);
-        sb->prev = NULL;
-        sb->next = NULL;
-        heap[heap_idx].sb_freelist = sb;
-    } else {
-        // add to front of reclaimed superblocks
-        sb->prev = NULL;
-        sb->next = heap[heap_idx].sb_freelist;
-        if ( heap[heap_idx].sb_freelist )
-            heap[heap_idx].sb_freelist->prev = sb;
-        heap[heap_idx].sb_freelist = sb;
-    }
+    lock_release(&span_lock);
+    DEBUG(DB_LARGELIST, "[a2alloc_trim] Gave %lu bytes of free spans back\n", bytes);
+    return bytes;
 }
 
-//map to free taken care of
-//free to map taken care of
-//free to free
-
-int getHeapBlocksCount(const int cpu_count)
+/**
+ * How many bytes are in free spans right now
+ */
+unsigned long a2alloc_free_span_bytes(void)
 {
-    return (sizeof (struct sb_heap) * (cpu_count + 1) / SB_SIZE) + 1;
+    return __atomic_load_n(&span_pages_free, __ATOMIC_RELAXED) * SB_SIZE;
 }
 
 /**
- * calculate the ratio of how much space is used
- **/
-float calculate_ratio(struct superblock * sb)
+ * The region the given heap grows in, mapping one if it has none yet
+ * Must be called with the heap's grow_lock held
+ */
+struct region * heap_region(const unsigned int heap_idx)
 {
-    return 1.0 * (sb->max_segs - sb->free_count) / sb->max_segs;
+    if (heap[heap_idx].region == NULL) {
+        __atomic_store_n(&heap[heap_idx].region, region_map(), __ATOMIC_RELEASE);
+    }
+    return heap[heap_idx].region;
 }
 
-/* move/insert superblock to the front of the sb_map list */
-void insert_sb_in_front(struct superblock * in_front, const int heap_idx, const int map_idx)
+/**
+ * Hand out size more bytes of the given heap's region. When they don't fit,
+ * the heap moves on to a new region and leaves the old one to drain
+ * Must be called with the heap's grow_lock held
+ * Return NULL if there's no memory left
+ */
+void * region_grow(const unsigned int heap_idx, const size_t size)
 {
-    // avoid loops
-    if (heap[heap_idx].sb_map[map_idx] == in_front) return;
-    assert (in_front != NULL);
+    assert(size % SB_SIZE == 0 && size <= REGION_BLOCK_MAX);
 
-    //isolate in front from list
-    if (in_front->prev != NULL) in_front->prev->next = in_front->next;
-    if (in_front->next != NULL) in_front->next->prev = in_front->prev;
-    in_front->prev = NULL;
-    in_front->next = NULL;
+    struct region * r = heap_region(heap_idx);
+    void * addr = r != NULL ? mem_region_sbrk(&r->mem, size) : NULL;
 
-    struct superblock * current_front = heap[heap_idx].sb_map[map_idx];
+    if (r != NULL && addr == NULL) {
+        struct region * fresh = region_map();
+        if (fresh != NULL && (addr = mem_region_sbrk(&fresh->mem, size)) != NULL) {
+            __atomic_store_n(&heap[heap_idx].region, fresh, __ATOMIC_RELEASE);
 
-    //add in_front to the front of target
-    in_front->prev = NULL;
-    in_front->next = current_front;
-    if (current_front != NULL) {
-        current_front->prev = in_front;
+            // everything in it may have been freed already
+            lock_acquire(&span_lock);
+            r->full = true;
+            region_release_if_free(r);
+            lock_release(&span_lock);
+        }
     }
-    heap[heap_idx].sb_map[map_idx] = in_front;
-}
 
-void make_heap(const int heap_idx) {
-    heap[heap_idx].sb_freelist = NULL;
-    heap[heap_idx].cur_f = 0;
-    heap[heap_idx].total_f = 0;
-    heap[heap_idx].cur_k = 0;
-    pthread_mutexattr_t attrs;
-    pthread_mutexattr_init(&attrs);
-    pthread_mutex_init(&(heap[heap_idx].heap_lock), &attrs);
+    if (addr == NULL) {
+        fprintf(stderr, "[region_grow] couldn't grow heap %u by %lu bytes, ran out of memory\n", heap_idx, size);
+    }
+    return addr;
 }
 
-////////////////////////////////// MAIN WORKHORSE FUNCTIONS ///////////////////////
-int mm_init(void)
+/**
+ * Cut size bytes off the front of the given heap's chunk
+ * Return NULL if the chunk is too short, or being replaced
+ */
+void * heap_cut(const unsigned int heap_idx, const size_t size)
 {
-    if (dseg_lo == NULL && dseg_hi == NULL) {
-        int result = mem_init();
-        DEBUG(DB_INIT, "[mm_init] dseg_lo at %p and dseg_hi at %p\n", dseg_lo, dseg_hi);
-        TOP = dseg_lo;
-
-        DEBUG(DB_INIT, "[mm_init] init_TOP: %p\n", TOP);
-
-        //initilize heap; dseg_hi initially dseg_lo-1;
-        //global heap is heap 0;
-        int cpu_count = getNumProcessors();
-        int heap_blocks_count = getHeapBlocksCount(cpu_count);
-        heap = mem_sbrk(heap_blocks_count * SB_SIZE) + 1;
-        TOP += heap_blocks_count * SB_SIZE;
-        int i, j;
-        for (j = 0; j <= cpu_count; j++) {
-            for (i = 0; i < NUM_SEGS; i++) {
-                heap[j].sb_map[i] = NULL;
-            }
+    struct sb_heap * h = &heap[heap_idx];
+    void * next = __atomic_load_n(&h->chunk_next, __ATOMIC_ACQUIRE);
+
+    // a refill clears chunk_next before it moves chunk_end, so if the CAS
+    // succeeds, next and the end it was checked against are of one chunk
+    // (or next is where the old chunk ended and the new one begins)
+    while (next != NULL && next + size <= __atomic_load_n(&h->chunk_end, __ATOMIC_ACQUIRE)) {
+        if (__atomic_compare_exchange_n(&h->chunk_next, &next, next + size, true,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            return next;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Give the given heap a new chunk, and what was left of the old one to the
+ * free spans
+ * Must be called with the heap's grow_lock held
+ * Return false if there's no memory left
+ */
+bool heap_refill(const unsigned int heap_idx)
+{
+    struct sb_heap * h = &heap[heap_idx];
+    void * chunk = region_grow(heap_idx, HEAP_CHUNK_SIZE);
+    if (chunk == NULL) return false;
+
+    // nobody cuts from the old chunk once chunk_next is NULL
+    void * left = __atomic_exchange_n(&h->chunk_next, NULL, __ATOMIC_ACQ_REL);
+    if (left != NULL && left < h->chunk_end) {
+        span_free(left, (h->chunk_end - left) / SB_SIZE);
+    }
+
+    __atomic_store_n(&h->chunk_end, chunk + HEAP_CHUNK_SIZE, __ATOMIC_RELEASE);
+    __atomic_store_n(&h->chunk_next, chunk, __ATOMIC_RELEASE);
+    DEBUG(DB_MAKE_SUPERBLOCK, "[heap_refill] Heap %u now cuts from %p\n", heap_idx, chunk);
+    return true;
+}
+
+// bytes of fresh memory all heaps have grown by (see heap_grow), which is
+// what mm_malloc(0) reports
+static unsigned long heap_grown __attribute__((aligned(64))) = 0;
+
+/**
+ * Get size bytes (whole pages) of fresh memory for the given heap, from its
+ * chunk if they fit, otherwise from a new chunk or straight from its region
+ * Return NULL if there's no memory left
+ */
+void * heap_grow(const unsigned int heap_idx, const size_t size)
+{
+    assert(size % SB_SIZE == 0);
+    void * addr = heap_cut(heap_idx, size);
+    if (addr == NULL) {
+        lock_acquire(&heap[heap_idx].grow_lock);
+        if (size > HEAP_CHUNK_SIZE) {
+            addr = region_grow(heap_idx, size);
+        } else {
+            // the chunk may have been refilled while we waited, and others may
+            // cut the new one short before we get to it
+            while ((addr = heap_cut(heap_idx, size)) == NULL && heap_refill(heap_idx));
+        }
+        lock_release(&heap[heap_idx].grow_lock);
+    }
+
+    if (addr != NULL) __atomic_add_fetch(&heap_grown, size, __ATOMIC_RELAXED);
+    return addr;
+}
+
+struct superblock * make_superblock(const int segment_size, const unsigned int heap_idx) {
+    assert(segment_size > 0);
+    unsigned int sb_size = SEG_SB_SIZES[get_seg_index(segment_size)];
+
+    void * begin = span_alloc(sb_size / SB_SIZE);
+    if (begin == NULL) {
+        DEBUG(DB_MAKE_SUPERBLOCK, "[make_superblock] Growing heap %u by %u\n", heap_idx, sb_size);
+        begin = heap_grow(heap_idx, sb_size);
+        if (begin == NULL) return NULL;
+    }
+
+    // clear out any crap that might be in here from before; segments are
+    // carved lazily, so only the header needs it. No lock is held here
+    bzero(begin, sizeof (struct superblock));
+
+    // keep all superblock information in first segment of superblock
+    struct superblock* sb = (struct superblock *) begin;
+    DEBUG(DB_MAKE_SUPERBLOCK, "[make_superblock] Creating new SB at address %p with segment size %u\n", begin, segment_size);
+
+    sb->seg_size = 0; // clear superblock needs this to check if this is a newly reclaimed guy
+    sb->sb_size = sb_size;
+    sb->remote_freelist = NULL;
+    sb->remote_queued = false;
+    sb->next = NULL;
+    sb->prev = NULL;
+    sb->reclaimed = false;
+
+    clear_superblock(sb, segment_size);
+    return sb;
+}
+
+//large blocks for allocation > SB_SIZE/2, from a free span if there is one,
+//otherwise from the region of the calling thread's heap
+struct largeblock * make_largeblock(const size_t allocation_size) {
+    unsigned long target_alloc = (allocation_size + sizeof(struct largeblock) + SB_SIZE - 1) / SB_SIZE * SB_SIZE;
+    assert(target_alloc > 0);
+    assert(target_alloc % SB_SIZE == 0);
+    DEBUG(DB_MAKE_SUPERBLOCK, "[make_largeblock] Target allocation is %lu\n", target_alloc);
+
+    void * begin = span_alloc(target_alloc / SB_SIZE);
+    if (begin == NULL) {
+        begin = heap_grow(get_heap_index(), target_alloc);
+        if (begin == NULL) return NULL;
+    }
+    DEBUG(DB_MAKE_SUPERBLOCK, "[make_largeblock] Creating largeblock at address %p spanning %lu superblocks\n", begin, target_alloc / SB_SIZE);
+
+    struct largeblock* lb = (struct largeblock *) begin;
+    lb->size = target_alloc/SB_SIZE;
+    DEBUG(DB_MAKE_SUPERBLOCK, "[make_largeblock] Creating largeblock size is %d superblocks\n", lb->size);
+
+    pagemap_set(lb, target_alloc, PAGE_LARGE, lb, 0);
+    return lb;
+}
+
+//////////////////////////////// HUGE BLOCKS ////////////////////////////////
+// Blocks of A2ALLOC_MMAP_THRESHOLD bytes or more are mapped one by one. They
+// start with the same header as large blocks, counting the pages of the
+// mapping, and only their first page goes into the page map (as PAGE_HUGE),
+// since that's the only one a pointer handed out can be in.
+
+static unsigned long huge_bytes = 0;
+
+/**
+ * Map a huge block with room for allocation_size bytes after the header
+ */
+struct largeblock * make_hugeblock(const size_t allocation_size)
+{
+    size_t bytes = (allocation_size + sizeof(struct largeblock) + (1UL << PAGE_SHIFT) - 1) & ~((1UL << PAGE_SHIFT) - 1);
+    void * begin = mem_map(bytes);
+    if (begin == NULL) {
+        fprintf(stderr, "[make_hugeblock] mmap of %lu bytes failed\n", bytes);
+        return NULL;
+    }
+
+    struct largeblock * lb = (struct largeblock *) begin;
+    lb->size = bytes >> PAGE_SHIFT;
+    pagemap_set(lb, 1UL << PAGE_SHIFT, PAGE_HUGE, lb, 0);
+    __atomic_add_fetch(&huge_bytes, bytes, __ATOMIC_RELAXED);
+    DEBUG(DB_LARGELIST, "[make_hugeblock] Mapped %lu bytes at %p\n", bytes, lb);
+    return lb;
+}
+
+/**
+ * Unmap a huge block; its memory goes straight back to the OS
+ */
+void free_huge(void * addr, struct largeblock * lb)
+{
+    assert(addr == (void *)lb + sizeof(struct largeblock));
+    size_t bytes = (size_t) lb->size << PAGE_SHIFT;
+
+    // forget the block before the address can be mapped again
+    pagemap_set(lb, 1UL << PAGE_SHIFT, PAGE_UNUSED, NULL, 0);
+    __atomic_sub_fetch(&huge_bytes, bytes, __ATOMIC_RELAXED);
+    DEBUG(DB_LARGELIST, "[free_huge] Unmapping %lu bytes at %p\n", bytes, lb);
+    if (mem_unmap(lb, bytes) != 0) {
+        fprintf(stderr, "[free_huge] munmap of %lu bytes at %p failed\n", bytes, lb);
+    }
+}
+
+/**
+ * Resize a huge block to hold allocation_size bytes after the header. The
+ * kernel moves the pages if the block can't grow in place, so nothing is
+ * copied. Return the block's new header, or NULL (and leave the block as it
+ * was) if that fails
+ */
+struct largeblock * remap_hugeblock(struct largeblock * lb, const size_t allocation_size)
+{
+    size_t old_bytes = (size_t) lb->size << PAGE_SHIFT;
+    size_t bytes = (allocation_size + sizeof(struct largeblock) + (1UL << PAGE_SHIFT) - 1) & ~((1UL << PAGE_SHIFT) - 1);
+    if (bytes == old_bytes) return lb;
+
+    void * begin = mem_remap(lb, old_bytes, bytes);
+    if (begin == NULL) {
+        DEBUG(DB_LARGELIST, "[remap_hugeblock] mremap of %p to %lu bytes failed\n", lb, bytes);
+        return NULL;
+    }
+    if (begin != (void *) lb) {
+        pagemap_set(lb, 1UL << PAGE_SHIFT, PAGE_UNUSED, NULL, 0);
+    }
+
+    lb = (struct largeblock *) begin;
+    lb->size = bytes >> PAGE_SHIFT;
+    pagemap_set(lb, 1UL << PAGE_SHIFT, PAGE_HUGE, lb, 0);
+    __atomic_add_fetch(&huge_bytes, bytes - old_bytes, __ATOMIC_RELAXED);
+    DEBUG(DB_LARGELIST, "[remap_hugeblock] %lu bytes now at %p\n", bytes, lb);
+    return lb;
+}
+
+/**
+ * How many bytes huge blocks have mapped right now
+ */
+unsigned long a2alloc_huge_bytes(void)
+{
+    return __atomic_load_n(&huge_bytes, __ATOMIC_RELAXED);
+}
+
+/**
+ * Size from which blocks get a mapping of their own
+ */
+unsigned long a2alloc_mmap_threshold(void)
+{
+    return A2ALLOC_MMAP_THRESHOLD;
+}
+
+#if SB_FREE_TRACKING == SB_TRACK_BITMAP
+/**
+ * Mark a segment of the superblock free
+ * Freeing a segment that is already free is reported and aborts, since it
+ * would otherwise hand the same segment out twice
+ */
+void sb_freelist_push (struct superblock * sb, struct freelist_node * fl_node)
+{
+    assert(sb != NULL);
+    assert(fl_node != NULL);
+
+    unsigned int i = ((void *) fl_node - (void *) sb) / sb->seg_size;
+    unsigned long bit = 1UL << (i % 64);
+    assert(i < SB_BITMAP_WORDS * 64);
+    if (sb->free_map[i / 64] & bit) {
+        fprintf(stderr, "[sb_freelist_push] double free of %p\n", fl_node);
+        abort();
+    }
+
+    sb->free_map[i / 64] |= bit;
+    sb->free_count++;
+}
+
+/**
+ * Return whether a segment of class seg_idx of the superblock is marked free
+ * Reads the bit without the heap's lock: bits only change for segments that
+ * are free or being freed, so for a segment the caller owns it reads clear
+ */
+bool sb_segment_free (struct superblock * sb, const unsigned int seg_idx, void * addr)
+{
+    unsigned int i = ((unsigned long) (addr - (void *) sb) * SEG_RECIPS[seg_idx]) >> 32;
+    assert(i == (addr - (void *) sb) / sb->seg_size);
+    assert(i < SB_BITMAP_WORDS * 64);
+    return (__atomic_load_n(&sb->free_map[i / 64], __ATOMIC_RELAXED) >> (i % 64)) & 1;
+}
+
+/**
+ * Take the lowest free segment of the superblock
+ */
+struct freelist_node * sb_freelist_pop (struct superblock * sb) {
+    assert(sb != NULL);
+    assert(sb->free_count > 0);
+
+    // free_count > 0 means some bit is set, so this stays in bounds
+    unsigned int w = 0;
+    while (sb->free_map[w] == 0) w++;
+    unsigned int i = w * 64 + __builtin_ctzl(sb->free_map[w]);
+    sb->free_map[w] &= sb->free_map[w] - 1;
+    sb->free_count--;
+
+    DEBUG(DB_MALLOC, "[sb_freelist_pop] Took segment %u, new free_count of SB is %u\n", i, sb->free_count);
+    return (struct freelist_node *) ((void *) sb + (unsigned long) i * sb->seg_size);
+}
+#else
+/**
+ * Add an element to the front of the sb freelist
+ */
+void sb_freelist_push (struct superblock * sb, struct freelist_node * fl_node)
+{
+    assert(sb != NULL);
+    assert(fl_node != NULL);
+
+    fl_node->next = sb->freelist;
+    sb->freelist = fl_node;
+    sb->free_count++;
+}
+
+/**
+ * Remove and return the first freelist node in the sb's freelist, or carve a
+ * new segment off the untouched end of the superblock if the freelist is empty
+ */
+struct freelist_node * sb_freelist_pop (struct superblock * sb) {
+    assert(sb != NULL);
+    assert(sb->free_count > 0);
+
+    struct freelist_node * node = sb->freelist;
+    if (node != NULL) {
+        DEBUG(DB_MALLOC, "[sb_freelist_pop] next is pointing to: %p\n", node->next);
+        sb->freelist = node->next;
+    } else {
+        // free_count > 0 with an empty freelist means there's uncarved space left
+        assert(sb->bump < sb->sb_size / sb->seg_size);
+        node = (struct freelist_node *) ((void *) sb + (unsigned long) sb->bump * sb->seg_size);
+        sb->bump++;
+    }
+    sb->free_count--;
+
+    DEBUG(DB_MALLOC, "[sb_freelist_pop] New free_count of SB is %u\n", sb->free_count);
+    return node;
+}
+#endif
+
+/**
+ * Put a superblock on its heap's stack of superblocks with remote frees for
+ * its class
+ * The caller must have just set sb->remote_queued
+ */
+void heap_queue_remote (const unsigned int heap_idx, struct superblock * sb)
+{
+    struct superblock ** stack = &heap[heap_idx].remote_sbs[get_seg_index(sb->seg_size)];
+    struct superblock * head = __atomic_load_n(stack, __ATOMIC_RELAXED);
+
+    // no ABA problem: the stack is only ever emptied as a whole, and
+    // remote_queued keeps a superblock from being on it twice
+    do {
+        sb->remote_next = head;
+    } while (!__atomic_compare_exchange_n(stack, &head, sb, true,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/**
+ * Push a segment onto the superblock's remote freelist
+ * Safe to call without any lock, from any thread, even while the superblock
+ * is changing owners: the list travels with the superblock
+ */
+void sb_remote_push (struct superblock * sb, void * addr)
+{
+    struct freelist_node * node = make_freelist_node(addr);
+    struct freelist_node * head = __atomic_load_n(&sb->remote_freelist, __ATOMIC_RELAXED);
+
+    // no ABA problem: nodes are only ever removed by swapping out the whole list
+    // seq_cst pairs with heap_drain_remote: either it sees this node after
+    // clearing remote_queued, or we see remote_queued clear and queue again
+    do {
+        node->next = head;
+    } while (!__atomic_compare_exchange_n(&sb->remote_freelist, &head, node, true,
+                                          __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+
+    if (!__atomic_load_n(&sb->remote_queued, __ATOMIC_SEQ_CST) &&
+            !__atomic_exchange_n(&sb->remote_queued, true, __ATOMIC_SEQ_CST)) {
+        heap_queue_remote(__atomic_load_n(&sb->heap_idx, __ATOMIC_RELAXED), sb);
+    }
+}
+
+/**
+ * Move everything on the superblock's remote freelist onto its freelist
+ * Must be called with the owning heap's lock for the superblock's class held
+ * Return the number of segments moved
+ */
+unsigned int sb_drain_remote (struct superblock * sb)
+{
+    if (__atomic_load_n(&sb->remote_freelist, __ATOMIC_RELAXED) == NULL) return 0;
+
+    struct freelist_node * node = __atomic_exchange_n(&sb->remote_freelist, NULL, __ATOMIC_SEQ_CST);
+    unsigned int drained = 0;
+    while (node != NULL) {
+        struct freelist_node * next = node->next;
+        sb_freelist_push(sb, node);
+        node = next;
+        drained++;
+    }
+
+    DEBUG(DB_REMOTE, "[sb_drain_remote] Drained %u remote frees into SB %p\n", drained, sb);
+    return drained;
+}
+
+/////////////////////////////// GLOBAL HEAP STACKS ///////////////////////////////
+// Heap 0 only ever holds reclaimed superblocks, so rather than lists under its
+// heap_lock it keeps them on lock-free stacks, one per superblock size.
+// A stack's head packs the page number of the top superblock with a counter
+// that every push and pop bumps, so a CAS that succeeds knows the top wasn't
+// popped and pushed back in between (no ABA). A popper may read the next
+// pointer of a superblock someone else has just taken, and that popper's CAS
+// then fails. Poppers hold one of a heap's locks, so global_sb_release can
+// wait for them before it lets the memory of superblocks it took go.
+
+#define SB_STACK_TAG_BITS   28
+#define SB_STACK_TAG_MASK   ((1UL << SB_STACK_TAG_BITS) - 1)
+
+struct sb_stack {
+    unsigned long head;
+} __attribute__((aligned(64)));
+
+// heap 0's reclaimed superblocks, by get_sb_size_index
+static struct sb_stack global_sb_stack[NUM_SB_SIZES];
+
+static inline struct superblock * sb_stack_top(const unsigned long head)
+{
+    return (struct superblock *) ((head >> SB_STACK_TAG_BITS) << PAGE_SHIFT);
+}
+
+/**
+ * Head value with sb on top, replacing old_head
+ */
+static inline unsigned long sb_stack_make_head(struct superblock * sb, const unsigned long old_head)
+{
+    return (((unsigned long) sb >> PAGE_SHIFT) << SB_STACK_TAG_BITS) | ((old_head + 1) & SB_STACK_TAG_MASK);
+}
+
+/**
+ * Push a chain of reclaimed superblocks of the same size, linked through
+ * next from first to last, onto a set of stacks (heap 0's or an LLC heap's)
+ * with a single CAS
+ */
+void sb_stack_push_chain(struct sb_stack * stacks, struct superblock * first, struct superblock * last)
+{
+    struct sb_stack * stack = &stacks[get_sb_size_index(first->sb_size)];
+    // the page numbers have to fit next to the tag
+    assert(((unsigned long) first & (SB_SIZE - 1)) == 0);
+    assert(((unsigned long) first >> (PAGE_SHIFT + 64 - SB_STACK_TAG_BITS)) == 0);
+
+    unsigned long head = __atomic_load_n(&stack->head, __ATOMIC_RELAXED);
+    do {
+        __atomic_store_n(&last->next, sb_stack_top(head), __ATOMIC_RELAXED);
+    } while (!__atomic_compare_exchange_n(&stack->head, &head, sb_stack_make_head(first, head), true,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/**
+ * Push a reclaimed superblock onto heap 0
+ */
+void global_sb_push(struct superblock * sb)
+{
+    sb->prev = NULL;
+    sb_stack_push_chain(global_sb_stack, sb, sb);
+}
+
+/**
+ * Pop up to max reclaimed superblocks of the given size off a set of stacks
+ * with a single CAS. They come back as a chain linked through next, and *count is
+ * set to its length.
+ * If the head and its tag haven't changed by the CAS, nobody pushed or popped
+ * in the meantime, so the chain walked before it is still the top of the stack.
+ * Return NULL if there are none
+ */
+struct superblock * sb_stack_pop_batch(struct sb_stack * stacks, const unsigned int size_idx,
+                                      const unsigned int max, unsigned int * count)
+{
+    struct sb_stack * stack = &stacks[size_idx];
+    struct superblock * first;
+    struct superblock * last;
+    struct superblock * next;
+    unsigned int n;
+
+    assert(max > 0);
+
+    // acquire, so the next pointers read below are the ones their pushers wrote
+    unsigned long head = __atomic_load_n(&stack->head, __ATOMIC_ACQUIRE);
+    do {
+        first = sb_stack_top(head);
+        if (first == NULL) {
+            *count = 0;
+            return NULL;
+        }
+        last = first;
+        n = 1;
+        while (n < max && (next = __atomic_load_n(&last->next, __ATOMIC_RELAXED)) != NULL) {
+            last = next;
+            n++;
+        }
+    } while (!__atomic_compare_exchange_n(&stack->head, &head,
+                                          sb_stack_make_head(__atomic_load_n(&last->next, __ATOMIC_RELAXED), head),
+                                          true, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE));
+
+    last->next = NULL;
+    *count = n;
+    return first;
+}
+
+//////////////////////////////// LLC HEAPS ////////////////////////////////
+// Between the per-CPU heaps and heap 0 sits one heap per last-level cache, so
+// superblocks a CPU gives back are reused by CPUs sharing its cache before
+// they can end up on the other side of the machine. Like heap 0 they only
+// hold reclaimed superblocks, on the same kind of lock-free stacks.
+// Machines with a single LLC don't get any; the per-CPU heaps then talk to
+// heap 0 directly.
+
+struct llc_heap {
+    struct sb_stack stacks[NUM_SB_SIZES];
+    // superblocks on the stacks; updated after the fact, so only roughly
+    long count;
+} __attribute__((aligned(64)));
+
+static struct llc_heap * llc_heaps = NULL;
+static unsigned int num_llcs = 0;
+
+/**
+ * Set up a heap per last-level cache; per-CPU heaps are put in their CPU's
+ * group as they are made
+ */
+void llc_heaps_init(void)
+{
+    num_llcs = topo_num_llcs();
+    DEBUG(DB_INIT, "[llc_heaps_init] %u last-level caches\n", num_llcs);
+    if (num_llcs <= 1) return;
+
+    void * mem = mmap(NULL, num_llcs * sizeof (struct llc_heap), PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+        fprintf(stderr, "[llc_heaps_init] mmap failed, going to heap 0 directly\n");
+        return;
+    }
+    llc_heaps = mem;
+}
+
+/**
+ * Pop up to max reclaimed superblocks of the given size off an LLC heap
+ */
+struct superblock * llc_heap_pop_batch(const unsigned int llc_idx, const unsigned int size_idx,
+                                       const unsigned int max, unsigned int * count)
+{
+    struct llc_heap * llc = &llc_heaps[llc_idx];
+    struct superblock * sb = sb_stack_pop_batch(llc->stacks, size_idx, max, count);
+    if (sb != NULL) __atomic_sub_fetch(&llc->count, *count, __ATOMIC_RELAXED);
+    return sb;
+}
+
+/**
+ * Move a batch of reclaimed superblocks of the given size from an LLC heap
+ * to heap 0
+ * Return how many moved
+ */
+unsigned int llc_heap_give_batch(const unsigned int llc_idx, const unsigned int size_idx)
+{
+    unsigned int count;
+    struct superblock * first = llc_heap_pop_batch(llc_idx, size_idx, SB_TRANSFER_BATCH, &count);
+    if (first == NULL) return 0;
+
+    struct superblock * last = first;
+    while (last->next != NULL) last = last->next;
+    sb_stack_push_chain(global_sb_stack, first, last);
+    DEBUG(DB_FREE, "[llc_heap_give_batch] LLC heap %u gave %u superblocks to heap 0\n", llc_idx, count);
+    return count;
+}
+
+/**
+ * An LLC heap holding more than LLC_K_thresh superblocks gives batches of
+ * them, biggest first, to heap 0 until it's down to LLC_keep_frac of that.
+ * Unlike maybe_move_up_tier there's no emptiness test: all of them are empty
+ */
+void llc_heap_overflow(const unsigned int llc_idx)
+{
+    struct llc_heap * llc = &llc_heaps[llc_idx];
+    long keep = LLC_keep_frac * LLC_K_thresh;
+
+    if (__atomic_load_n(&llc->count, __ATOMIC_RELAXED) <= LLC_K_thresh) return;
+
+    int size_idx;
+    for (size_idx = NUM_SB_SIZES - 1; size_idx >= 0; size_idx--) {
+        while (__atomic_load_n(&llc->count, __ATOMIC_RELAXED) > keep) {
+            if (llc_heap_give_batch(llc_idx, size_idx) == 0) break;
+        }
+    }
+}
+
+/**
+ * Give everything the LLC heaps hold to heap 0
+ */
+void llc_heaps_drain(void)
+{
+    unsigned int llc_idx, size_idx;
+
+    if (llc_heaps == NULL) return;
+    for (llc_idx = 0; llc_idx < num_llcs; llc_idx++) {
+        for (size_idx = 0; size_idx < NUM_SB_SIZES; size_idx++) {
+            while (llc_heap_give_batch(llc_idx, size_idx) > 0) continue;
+        }
+    }
+}
+
+/**
+ * How many reclaimed superblocks the LLC heaps hold right now
+ */
+unsigned long a2alloc_llc_superblocks(void)
+{
+    long count = 0;
+    unsigned int llc_idx;
+
+    if (llc_heaps == NULL) return 0;
+    for (llc_idx = 0; llc_idx < num_llcs; llc_idx++) {
+        count += __atomic_load_n(&llc_heaps[llc_idx].count, __ATOMIC_RELAXED);
+    }
+    return count > 0 ? count : 0;
+}
+
+/**
+ * Give a chain of reclaimed superblocks of the same size to the tier above
+ * the given per-CPU heap
+ */
+void move_up_tier(const int heap_idx, struct superblock * first, struct superblock * last, const unsigned int count)
+{
+    if (llc_heaps == NULL) {
+        sb_stack_push_chain(global_sb_stack, first, last);
+        return;
+    }
+
+    unsigned int llc_idx = heap[heap_idx].llc_idx;
+    sb_stack_push_chain(llc_heaps[llc_idx].stacks, first, last);
+    __atomic_add_fetch(&llc_heaps[llc_idx].count, count, __ATOMIC_RELAXED);
+    llc_heap_overflow(llc_idx);
+}
+
+/**
+ * Put a superblock at the front of the list starting at *head
+ */
+void sb_list_push(struct superblock ** head, struct superblock * sb)
+{
+    sb->prev = NULL;
+    sb->next = *head;
+    if (*head != NULL) {
+        (*head)->prev = sb;
+    }
+    *head = sb;
+}
+
+/**
+ * Unlink a superblock from the list starting at *head
+ * Does nothing to a superblock that isn't on any list
+ */
+void sb_list_remove(struct superblock ** head, struct superblock * sb)
+{
+    if (sb->prev) sb->prev->next = sb->next;
+    else if (*head == sb) *head = sb->next;
+    if (sb->next) sb->next->prev = sb->prev;
+    sb->prev = NULL;
+    sb->next = NULL;
+}
+
+/**
+ * Reclaim the given superblock
+ * + Remove from chain of blocks with same segsize
+ * + Set reclaimed = true
+ * A superblock in use must come with src's lock for its class held; the
+ * reclaimed lists are locked in here
+ */
+void reclaim_superblock (struct superblock * sb, const int src_idx, const int dest_idx)
+{
+    assert(sb != NULL);
+    assert(sb->free_count == sb->max_segs);
+
+    int heap_idx = dest_idx;
+
+    //reclaim comes from the bins and the freelist
+    unsigned int size_idx = get_sb_size_index(sb->sb_size);
+    if (sb->reclaimed) {
+        lock_acquire(&(heap[src_idx].heap_lock));
+        sb_list_remove(&heap[src_idx].sb_freelist[size_idx], sb);
+        lock_release(&(heap[src_idx].heap_lock));
+    } else {
+        unsigned int seg_idx = get_seg_index(sb->seg_size);
+        sb_list_remove(&heap[src_idx].classes[seg_idx].bins[sb->bin], sb);
+    }
+    sb->reclaimed = true;
+    sb->heap_idx = dest_idx;
+
+    if (dest_idx == 0) {
+        global_sb_push(sb);
+        return;
+    }
+
+    // add to front of reclaimed superblocks
+    lock_acquire(&(heap[heap_idx].heap_lock));
+    DEBUG(DB_FREE, "[mm_free] first element of freelist is %p\n", heap[heap_idx].sb_freelist[size_idx]);
+    sb_list_push(&heap[heap_idx].sb_freelist[size_idx], sb);
+    lock_release(&(heap[heap_idx].heap_lock));
+}
+
+//map to free taken care of
+//free to map taken care of
+//free to free
+
+/**
+ * calculate the ratio of how much space is used
+ **/
+float calculate_ratio(struct superblock * sb)
+{
+    return 1.0 * (sb->max_segs - sb->free_count) / sb->max_segs;
+}
+
+/**
+ * Which of its class's bins a superblock in use belongs on
+ */
+unsigned int sb_fullness_bin(struct superblock * sb)
+{
+    if (sb->free_count == 0) return SB_FULL_BIN;
+    return (sb->max_segs - sb->free_count) * SB_FULLNESS_BINS / sb->max_segs;
+}
+
+/**
+ * Put a superblock that isn't on any list on the front of its fullness bin
+ */
+void sb_bin_insert(struct superblock * sb, const int heap_idx)
+{
+    unsigned int seg_idx = get_seg_index(sb->seg_size);
+    sb->bin = sb_fullness_bin(sb);
+    sb_list_push(&heap[heap_idx].classes[seg_idx].bins[sb->bin], sb);
+}
+
+/**
+ * Move a superblock to the bin matching its current fullness, if it isn't there
+ */
+void sb_rebin(struct superblock * sb, const int heap_idx)
+{
+    if (sb_fullness_bin(sb) == sb->bin) return;
+
+    unsigned int seg_idx = get_seg_index(sb->seg_size);
+    sb_list_remove(&heap[heap_idx].classes[seg_idx].bins[sb->bin], sb);
+    sb_bin_insert(sb, heap_idx);
+}
+
+void make_heap(const int heap_idx) {
+    int i, j;
+    for (i = 0; i < NUM_SEGS; i++) {
+        for (j = 0; j < SB_NUM_BINS; j++) {
+            heap[heap_idx].classes[i].bins[j] = NULL;
+        }
+        heap[heap_idx].classes[i].lock_waits = 0;
+        heap[heap_idx].remote_sbs[i] = NULL;
+    }
+    for (i = 0; i < NUM_SB_SIZES; i++) {
+        heap[heap_idx].sb_freelist[i] = NULL;
+    }
+    heap[heap_idx].cur_f = 0;
+    heap[heap_idx].total_f = 0;
+    heap[heap_idx].cur_k = 0;
+    heap[heap_idx].llc_idx = 0;
+    heap[heap_idx].ops = 0;
+    heap[heap_idx].ops_at_scan = 0;
+    heap[heap_idx].threads = 0;
+    heap[heap_idx].region = NULL;
+    heap[heap_idx].chunk_next = NULL;
+    heap[heap_idx].chunk_end = NULL;
+    for (i = 0; i < NUM_SEGS; i++) {
+        lock_init(&(heap[heap_idx].classes[i].lock));
+    }
+    lock_init(&(heap[heap_idx].heap_lock));
+    lock_init(&(heap[heap_idx].grow_lock));
+}
+
+/**
+ * Adjust a heap's segment and superblock counts by the given amounts
+ */
+void heap_count(const unsigned int heap_idx, const int cur_f, const int total_f, const int cur_k)
+{
+    if (cur_f != 0) __atomic_add_fetch(&heap[heap_idx].cur_f, cur_f, __ATOMIC_RELAXED);
+    if (total_f != 0) __atomic_add_fetch(&heap[heap_idx].total_f, total_f, __ATOMIC_RELAXED);
+    if (cur_k != 0) __atomic_add_fetch(&heap[heap_idx].cur_k, cur_k, __ATOMIC_RELAXED);
+}
+
+//////////////////////////////// HEAP DIRECTORY ////////////////////////////////
+// Per-CPU heaps are made the first time a CPU asks for one, so a process
+// confined to a few CPUs of a big machine only pays for those. cpu_heap maps
+// a CPU id to its heap (0 until it has one). Once max_heaps heaps exist, new
+// CPUs share them round robin. The heap array's address space is reserved up
+// front, but its pages are only touched as heaps are made.
+
+#define HEAP_DIR_SIZE       TOPO_MAX_CPUS
+
+static unsigned int cpu_heap[HEAP_DIR_SIZE];
+// per-CPU heaps 1..heaps_made exist, and there may be up to max_heaps
+static unsigned int heaps_made = 0;
+static unsigned int max_heaps = 0;
+// where the next CPU goes once every heap is made
+static unsigned int heap_dir_next = 0;
+static struct alloc_lock heap_dir_lock = ALLOC_LOCK_INITIALIZER;
+// superblocks heaps had to grow by, to pace fold_idle_heaps; on a line of
+// its own, away from the directory that heap lookups read
+static unsigned long heap_grows __attribute__((aligned(64))) = 0;
+
+/**
+ * Reserve room for heap 0 and every per-CPU heap there may be, and make heap 0
+ * Return 0 on success, -1 on failure
+ */
+int heap_dir_init(const int cpu_count)
+{
+    max_heaps = HEAPS_PER_CPU * topo_num_usable();
+    if (max_heaps < 1) max_heaps = 1;
+
+    void * mem = mmap(NULL, (max_heaps + 1) * sizeof (struct sb_heap), PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (mem == MAP_FAILED) {
+        fprintf(stderr, "[heap_dir_init] mmap failed, cannot allocate heaps\n");
+        return -1;
+    }
+    heap = mem;
+    make_heap(0);
+    DEBUG(DB_INIT, "[heap_dir_init] Room for %u heaps for %d CPU ids\n", max_heaps, cpu_count);
+    return 0;
+}
+
+/**
+ * Make the next per-CPU heap and put it in the given CPU's LLC group
+ * Must be called with heap_dir_lock held, and with fewer than max_heaps made
+ */
+unsigned int heap_dir_make(const int cpu)
+{
+    assert(heaps_made < max_heaps);
+    unsigned int heap_idx = heaps_made + 1;
+    make_heap(heap_idx);
+    // map its region up front; if that fails region_grow tries again
+    heap[heap_idx].region = region_map();
+    heap[heap_idx].llc_idx = llc_heaps != NULL ? topo_llc_id(cpu) : 0;
+    __atomic_store_n(&heaps_made, heap_idx, __ATOMIC_RELEASE);
+    DEBUG(DB_INIT, "[heap_dir_make] Made heap %u for CPU %d\n", heap_idx, cpu);
+    return heap_idx;
+}
+
+/**
+ * Find or make the heap for a CPU that has none in the directory yet
+ */
+unsigned int heap_dir_assign(const int cpu)
+{
+    lock_acquire(&heap_dir_lock);
+    unsigned int heap_idx = cpu_heap[cpu];
+    if (heap_idx == 0) {
+        if (heaps_made < max_heaps) {
+            heap_idx = heap_dir_make(cpu);
+        } else {
+            heap_idx = heap_dir_next++ % max_heaps + 1;
+        }
+        __atomic_store_n(&cpu_heap[cpu], heap_idx, __ATOMIC_RELEASE);
+    }
+    lock_release(&heap_dir_lock);
+    return heap_idx;
+}
+
+/**
+ * Fold heaps that haven't refilled or flushed anything since the last scan
+ * into heap 0: pick up their remote frees and give all of their reclaimed
+ * superblocks to heap 0. Superblocks still in use stay, for their CPUs to
+ * come back to or for other heaps to steal. Locks that are busy right now
+ * are skipped, and so is heap skip_idx, one of whose locks the caller may hold.
+ * Return the number of heaps that gave anything back
+ */
+unsigned int fold_idle_heaps(const unsigned int skip_idx)
+{
+    unsigned int made = __atomic_load_n(&heaps_made, __ATOMIC_ACQUIRE);
+    unsigned int folded = 0;
+    unsigned int idx, i;
+
+    for (idx = 1; idx <= made; idx++) {
+        if (idx == skip_idx) continue;
+        unsigned long ops = __atomic_load_n(&heap[idx].ops, __ATOMIC_RELAXED);
+        if (ops == __atomic_exchange_n(&heap[idx].ops_at_scan, ops, __ATOMIC_RELAXED)) {
+            for (i = 0; i < NUM_SEGS; i++) {
+                if (!lock_try(&(heap[idx].classes[i].lock))) continue;
+                heap_drain_remote(idx, i);
+                lock_release(&(heap[idx].classes[i].lock));
+            }
+            if (!lock_try(&(heap[idx].heap_lock))) continue;
+            unsigned int moved = heap_give_reclaimed(idx, ~0U, 0, true);
+            lock_release(&(heap[idx].heap_lock));
+            if (moved > 0) {
+                DEBUG(DB_RECLAIM, "[fold_idle_heaps] Idle heap %u gave %u superblocks to heap 0\n", idx, moved);
+                folded++;
+            }
+        }
+    }
+    return folded;
+}
+
+/**
+ * Fold idle heaps into heap 0 now (see fold_idle_heaps)
+ */
+unsigned int a2alloc_fold_idle_heaps(void)
+{
+    return fold_idle_heaps(0);
+}
+
+/**
+ * Give heap 0's reclaimed superblocks, and those the LLC heaps hold, back as
+ * free spans, so that a region is unmapped once everything in it is free
+ * again. One that's queued for remote frees stays: the heap it's queued on
+ * will still look at it.
+ * Everyone else who may still touch a superblock taken here (remote frees
+ * and drains, stack pops) does so holding one of some heap's locks, so taking
+ * each of them once makes sure they're done before its memory is reused.
+ * Must be called without any lock held
+ * Return the number of superblocks given back
+ */
+unsigned int global_sb_release(void)
+{
+    struct superblock * taken = NULL;
+    struct superblock * sb;
+    struct superblock * next;
+    unsigned int released = 0;
+    unsigned int count, size_idx, idx, i;
+
+    // superblocks parked on an LLC heap would keep their regions mapped
+    llc_heaps_drain();
+
+    // heap 0 keeps no lists under its heap_lock; other calls here take it
+    // around their pops
+    lock_acquire(&(heap[0].heap_lock));
+    for (size_idx = 0; size_idx < NUM_SB_SIZES; size_idx++) {
+        struct superblock * keep_first = NULL;
+        struct superblock * keep_last = NULL;
+
+        while ((sb = sb_stack_pop_batch(global_sb_stack, size_idx, SB_TRANSFER_BATCH, &count)) != NULL) {
+            for (; sb != NULL; sb = next) {
+                next = sb->next;
+                // setting remote_queued also keeps a late remote free from
+                // queueing it from now on
+                if (__atomic_exchange_n(&sb->remote_queued, true, __ATOMIC_SEQ_CST)) {
+                    sb->next = keep_first;
+                    if (keep_last == NULL) keep_last = sb;
+                    keep_first = sb;
+                } else {
+                    sb->next = taken;
+                    taken = sb;
+                }
+            }
+        }
+        if (keep_first != NULL) {
+            sb_stack_push_chain(global_sb_stack, keep_first, keep_last);
+        }
+    }
+    lock_release(&(heap[0].heap_lock));
+    if (taken == NULL) return 0;
+
+    unsigned int made = __atomic_load_n(&heaps_made, __ATOMIC_ACQUIRE);
+    for (idx = 0; idx <= made; idx++) {
+        for (i = 0; i < NUM_SEGS; i++) {
+            lock_acquire(&(heap[idx].classes[i].lock));
+            lock_release(&(heap[idx].classes[i].lock));
+        }
+        lock_acquire(&(heap[idx].heap_lock));
+        lock_release(&(heap[idx].heap_lock));
+    }
+
+    for (sb = taken; sb != NULL; sb = next) {
+        next = sb->next;
+        unsigned long size = sb->sb_size;
+        // forget it was a superblock, so a stale pointer into it isn't taken for one
+        pagemap_set(sb, size, PAGE_UNUSED, NULL, 0);
+        span_free(sb, size / SB_SIZE);
+        released++;
+    }
+    DEBUG(DB_RECLAIM, "[global_sb_release] Gave %u superblocks back as free spans\n", released);
+    return released;
+}
+
+/**
+ * How many per-CPU heaps have been made so far
+ */
+unsigned int a2alloc_heaps_in_use(void)
+{
+    return __atomic_load_n(&heaps_made, __ATOMIC_RELAXED);
+}
+
+////////////////////////////////// MAIN WORKHORSE FUNCTIONS ///////////////////////
+// set once mm_init has run; heaps grow in regions of their own, so there is
+// no memlib data segment to tell by
+static bool initialized = false;
+
+int mm_init(void)
+{
+    if (!initialized) {
+        initialized = true;
+        DEBUG(DB_INIT, "[mm_init] Setting up a2alloc\n");
+
+        init_size_classes();
+
+        //global heap is heap 0; the per-CPU ones are made as CPUs show up
+        int cpu_count = topo_cpu_id_limit();
+        if (heap_dir_init(cpu_count) != 0) {
+            return -1;
+        }
+        llc_heaps_init();
+
+        pthread_key_create(&tcache_key, tcache_destroy);
+#if A2ALLOC_RSEQ
+        // per-CPU caches would mix the threads of a CPU back together
+        if (A2ALLOC_HEAP_POLICY == HEAP_POLICY_CPU) {
+            cpu_caches_init(cpu_count);
+        }
+#endif
+    }
+
+    return 0;
+}
+
+/**
+ * Return the segment size needed to store the given size
+ * Return value IS THE INDEX IN SEG_SIZES
+ * Do not call this function with size > MAX_SEG (= SEG_SIZES[NUM_SEGS - 1])
+ */
+unsigned int get_seg_size(const size_t size)
+{
+    assert (size <= MAX_SEG);
+    return size_to_seg_idx[(size + SEG_ALIGN - 1) / SEG_ALIGN];
+}
+
+/**
+ * The CPU the calling thread is running on, or 0 if sched_getcpu fails or
+ * returns an id the topology doesn't cover (hotplug)
+ */
+int current_cpu(void)
+{
+    int cpu = sched_getcpu();
+    if (cpu < 0 || cpu >= topo_cpu_id_limit()) return 0;
+    return cpu;
+}
+
+/**
+ * The heap of the CPU the calling thread is running on
+ */
+unsigned int get_cpu_heap_index()
+{
+    int cpu = sched_getcpu();
+    // CPU ids nobody expected (hotplug) share directory slots
+    if (cpu < 0) cpu = 0;
+    cpu %= HEAP_DIR_SIZE;
+
+    unsigned int heap_idx = __atomic_load_n(&cpu_heap[cpu], __ATOMIC_ACQUIRE);
+    if (heap_idx == 0) heap_idx = heap_dir_assign(cpu);
+    return heap_idx;
+}
+
+/**
+ * Make heap_idx the calling thread's heap, keeping the heaps' thread counts
+ */
+void thread_heap_set(const unsigned int heap_idx)
+{
+    if (thread_heap != 0) __atomic_sub_fetch(&heap[thread_heap].threads, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&heap[heap_idx].threads, 1, __ATOMIC_RELAXED);
+    thread_heap = heap_idx;
+    thread_lock_count = 0;
+    thread_lock_waits = 0;
+}
+
+/**
+ * Move a thread that keeps waiting for its heap's lock to a fresh heap if
+ * one may still be made, otherwise to the heap with the fewest threads, as
+ * long as that has fewer than its current one even with it added
+ */
+void thread_heap_rebalance(void)
+{
+    unsigned int best = thread_heap;
+    unsigned int best_threads = __atomic_load_n(&heap[thread_heap].threads, __ATOMIC_RELAXED) - 1;
+
+    lock_acquire(&heap_dir_lock);
+    if (heaps_made < max_heaps) {
+        best = heap_dir_make(current_cpu());
+    } else {
+        unsigned int idx;
+        for (idx = 1; idx <= heaps_made; idx++) {
+            unsigned int threads = __atomic_load_n(&heap[idx].threads, __ATOMIC_RELAXED);
+            if (threads < best_threads) {
+                best = idx;
+                best_threads = threads;
+            }
+        }
+    }
+    lock_release(&heap_dir_lock);
+
+    DEBUG(DB_MALLOC, "[thread_heap_rebalance] %u of %u lock acquisitions waited, moving from heap %u to %u\n", thread_lock_waits, thread_lock_count, thread_heap, best);
+    thread_heap_set(best);
+}
+
+/**
+ * The heap the calling thread should use, according to A2ALLOC_HEAP_POLICY
+ * or its binding
+ */
+unsigned int get_heap_index()
+{
+    if (thread_heap_bound) return thread_heap;
+#if A2ALLOC_HEAP_POLICY == HEAP_POLICY_THREAD
+    if (thread_heap == 0) {
+        thread_heap_set(get_cpu_heap_index());
+    } else if (thread_lock_count >= REBALANCE_WINDOW) {
+        if (thread_lock_waits >= REBALANCE_WAITS) {
+            thread_heap_rebalance();
+        } else {
+            thread_lock_count = 0;
+            thread_lock_waits = 0;
+        }
+    }
+    return thread_heap;
+#else
+    return get_cpu_heap_index();
+#endif
+}
+
+/**
+ * Lock a heap's size class, noting for rebalancing and a2alloc_lock_waits
+ * whether the thread had to wait
+ */
+void class_lock_acquire(const unsigned int heap_idx, const unsigned int seg_size_idx)
+{
+    thread_lock_count++;
+    if (!lock_acquire(&(heap[heap_idx].classes[seg_size_idx].lock))) return;
+    thread_lock_waits++;
+    __atomic_add_fetch(&heap[heap_idx].classes[seg_size_idx].lock_waits, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * How many times threads had to wait for a heap's lock for the size class
+ * of `size` bytes, or for any class if size is 0
+ */
+unsigned long a2alloc_lock_waits(const size_t size)
+{
+    if (size > MAX_SEG) return 0;
+
+    unsigned int made = __atomic_load_n(&heaps_made, __ATOMIC_ACQUIRE);
+    unsigned long waits = 0;
+    unsigned int idx, i;
+    for (idx = 1; idx <= made; idx++) {
+        for (i = 0; i < NUM_SEGS; i++) {
+            if (size != 0 && i != get_seg_size(size)) continue;
+            waits += __atomic_load_n(&heap[idx].classes[i].lock_waits, __ATOMIC_RELAXED);
+        }
+    }
+    return waits;
+}
+
+/**
+ * Bind the calling thread to a heap for logical worker `worker`: workers
+ * with the same number share a heap, and as long as there may be enough
+ * heaps different numbers get different ones. The binding overrides
+ * A2ALLOC_HEAP_POLICY until a2alloc_unbind_heap
+ * Return the heap's index
+ */
+unsigned int a2alloc_bind_heap(const unsigned int worker)
+{
+    unsigned int heap_idx = worker % max_heaps + 1;
+
+    // heaps are numbered in the order they are made
+    lock_acquire(&heap_dir_lock);
+    while (heaps_made < heap_idx) {
+        heap_dir_make(current_cpu());
+    }
+    lock_release(&heap_dir_lock);
+
+    thread_heap_set(heap_idx);
+    thread_heap_bound = true;
+    return heap_idx;
+}
+
+/**
+ * Undo a2alloc_bind_heap, going back to A2ALLOC_HEAP_POLICY
+ */
+void a2alloc_unbind_heap(void)
+{
+    if (!thread_heap_bound) return;
+    thread_heap_bound = false;
+#if A2ALLOC_HEAP_POLICY != HEAP_POLICY_THREAD
+    __atomic_sub_fetch(&heap[thread_heap].threads, 1, __ATOMIC_RELAXED);
+    thread_heap = 0;
+#endif
+}
+
+/**
+ * Get a reclaimed superblock that's on no list ready to be used for seg_size
+ */
+void reuse_reclaimed_superblock(struct superblock * sb, const unsigned int seg_size)
+{
+    if (sb->seg_size == seg_size) {
+        // still fully free and laid out for this class, so keep it as it is
+        DEBUG(DB_MALLOC, "[reuse_reclaimed_superblock] Reusing superblock %p without clearing it\n", sb);
+        assert(sb->free_count == sb->max_segs);
+        __atomic_store_n(&sb->reclaimed, false, __ATOMIC_RELEASE);
+    } else {
+        DEBUG(DB_MALLOC, "[reuse_reclaimed_superblock] Clearing reclaimed superblock\n");
+        clear_superblock(sb, seg_size);
+    }
+    DEBUG(DB_MALLOC, "[reuse_reclaimed_superblock] Got back superblock starting at %p, seg_size %u, free_count %u\n", sb, sb->seg_size, sb->free_count);
+}
+
+/**
+ * Unlink a superblock from the given heap's reclaimed superblocks, preferring
+ * one that was last used for seg_size (looking at most RECLAIM_SCAN deep) so
+ * it can be handed out again without being cleared
+ * Must be called with heap_lock held, and with a non-empty sb_freelist for
+ * the class's superblock size
+ */
+struct superblock * take_reclaimed_superblock(const unsigned int heap_idx, const unsigned int seg_size)
+{
+    unsigned int size_idx = get_sb_size_index(SEG_SB_SIZES[get_seg_index(seg_size)]);
+    struct superblock * new_sb = heap[heap_idx].sb_freelist[size_idx];
+    struct superblock * cur = new_sb;
+    int i;
+    for (i = 0; cur != NULL && i < RECLAIM_SCAN; i++, cur = cur->next) {
+        if (cur->seg_size == seg_size) {
+            new_sb = cur;
+            break;
+        }
+    }
+
+    sb_list_remove(&heap[heap_idx].sb_freelist[size_idx], new_sb);
+    return new_sb;
+}
+
+/**
+ * Find a reclaimed superblock.
+ * First look in own sb_freeelist, then on the LLC heap's stacks, then on the
+ * global heap's. From those take a batch, keeping the rest as own reclaimed
+ * superblocks; all of them count towards this heap's cur_k
+ * Must be called with the heap's lock for the class held, but not heap_lock
+ * Return NULL on failure
+ */
+void * find_reclaimed_superblock(const unsigned int heap_idx, const unsigned int seg_size)
+{
+    unsigned int size_idx = get_sb_size_index(SEG_SB_SIZES[get_seg_index(seg_size)]);
+    struct superblock * new_sb = NULL;
+    if (__atomic_load_n(&heap[heap_idx].sb_freelist[size_idx], __ATOMIC_RELAXED) != NULL) {
+        lock_acquire(&(heap[heap_idx].heap_lock));
+        if (heap[heap_idx].sb_freelist[size_idx]) {
+            DEBUG(DB_MALLOC_TOPLVL, "[find_reclaimed_superblock] Found superblock %p in reclaimed superblocks for heap %u\n", heap[heap_idx].sb_freelist[size_idx], heap_idx);
+            new_sb = take_reclaimed_superblock(heap_idx, seg_size);
+        }
+        lock_release(&(heap[heap_idx].heap_lock));
+    }
+    if (new_sb != NULL) {
+        // off every list now, so it can be set up without the lock
+        reuse_reclaimed_superblock(new_sb, seg_size);
+        return (void *) new_sb;
+    }
+
+    unsigned int count;
+    if (llc_heaps != NULL && heap_idx != 0) {
+        new_sb = llc_heap_pop_batch(heap[heap_idx].llc_idx, size_idx, SB_TRANSFER_BATCH, &count);
+    }
+    if (new_sb == NULL) {
+        new_sb = sb_stack_pop_batch(global_sb_stack, size_idx, SB_TRANSFER_BATCH, &count);
+    }
+    if (new_sb == NULL) return NULL;
+
+    DEBUG(DB_MALLOC, "[find_reclaimed_superblock] Took %u reclaimed superblocks from a higher tier\n", count);
+    heap_count(heap_idx, 0, 0, count);
+
+    struct superblock * sb = new_sb->next;
+    if (sb != NULL) {
+        lock_acquire(&(heap[heap_idx].heap_lock));
+        while (sb != NULL) {
+            struct superblock * next = sb->next;
+            sb->heap_idx = heap_idx;
+            sb_list_push(&heap[heap_idx].sb_freelist[size_idx], sb);
+            sb = next;
+        }
+        lock_release(&(heap[heap_idx].heap_lock));
+    }
+
+    new_sb->next = NULL;
+    reuse_reclaimed_superblock(new_sb, seg_size);
+    return (void *) new_sb;
+}
+
+/**
+ * Look for a superblock of the given class to take from another heap, whose
+ * lock for the class we hold. Take from the emptiest bin that has any and, within
+ * it, the emptiest superblock, preferring the one furthest down the bin
+ * (bins are pushed to and used from the front, so that's the least recently
+ * used one)
+ * Return NULL if there's nothing worth taking
+ */
+struct superblock * steal_pick(const unsigned int seg_size_idx, const unsigned int victim_idx)
+{
+    unsigned int bin;
+    for (bin = 0; bin < STEAL_MAX_BIN; bin++) {
+        struct superblock * best = NULL;
+        struct superblock * cur = heap[victim_idx].classes[seg_size_idx].bins[bin];
+        int i;
+        for (i = 0; cur != NULL && i < STEAL_SCAN; i++, cur = cur->next) {
+            if (best == NULL || cur->free_count >= best->free_count) best = cur;
+        }
+        if (best != NULL) return best;
+    }
+    return NULL;
+}
+
+/**
+ * Adopt a partially free superblock of the given class from another heap,
+ * so a heap whose threads moved in doesn't grow while the one they left
+ * sits on free segments.
+ * Must be called with the heap's lock for the class held. Other heaps'
+ * locks are only ever trylocked, so this can't deadlock against a heap
+ * stealing from us, and both heaps' locks for the class are held while the
+ * superblock changes hands.
+ * Return NULL if no heap had one to spare
+ */
+struct superblock * steal_superblock(const unsigned int seg_size_idx, const unsigned int heap_idx)
+{
+    unsigned int victim_idx = heap_idx;
+    unsigned int made = __atomic_load_n(&heaps_made, __ATOMIC_ACQUIRE);
+    unsigned int i;
+
+    if (heap_idx == 0 || made < 2) return NULL;
+    unsigned int tries = made - 1 < STEAL_HEAPS ? made - 1 : STEAL_HEAPS;
+
+    for (i = 0; i < tries; i++) {
+        // the per-CPU heaps are 1..made
+        victim_idx = victim_idx % made + 1;
+        assert(victim_idx != heap_idx);
+
+        // only look at heaps that seem to have something, without their lock
+        unsigned int bin;
+        for (bin = 0; bin < STEAL_MAX_BIN; bin++) {
+            if (__atomic_load_n(&heap[victim_idx].classes[seg_size_idx].bins[bin], __ATOMIC_RELAXED) != NULL) break;
+        }
+        if (bin == STEAL_MAX_BIN) continue;
+        struct alloc_lock * victim_lock = &(heap[victim_idx].classes[seg_size_idx].lock);
+        if (!lock_try(victim_lock)) continue;
+
+        struct superblock * sb = steal_pick(seg_size_idx, victim_idx);
+        if (sb == NULL) {
+            lock_release(victim_lock);
+            continue;
+        }
+
+        // remote frees were counted as in use by the victim, so settle them there
+        int drained = sb_drain_remote(sb);
+        int used = sb->max_segs - sb->free_count;
+        sb_list_remove(&heap[victim_idx].classes[seg_size_idx].bins[sb->bin], sb);
+        heap_count(victim_idx, -drained - used, -(int) sb->max_segs, -1);
+
+        // a thread freeing into it checks heap_idx under its own heap's lock
+        // for the class, and we hold both
+        sb->heap_idx = heap_idx;
+        heap_count(heap_idx, used, sb->max_segs, 1);
+        lock_release(victim_lock);
+
+        __atomic_add_fetch(&sb_steals, 1, __ATOMIC_RELAXED);
+        DEBUG(DB_MALLOC, "[steal_superblock] Heap %u took superblock %p with %u of %u free from heap %u\n", heap_idx, sb, sb->free_count, sb->max_segs, victim_idx);
+        return sb;
+    }
+    return NULL;
+}
 
-            make_heap(j);
-        }
+/**
+ * How many superblocks heaps took from other heaps instead of making new ones
+ */
+unsigned long a2alloc_superblocks_stolen(void)
+{
+    return __atomic_load_n(&sb_steals, __ATOMIC_RELAXED);
+}
+
+/**
+ * Give the given heap another superblock for the given size class, either a
+ * reclaimed superblock, one stolen from another heap or a brand new one,
+ * and put it in front of its sb_list
+ * Must be called with the heap's lock for the class held. The lock is held
+ * on return, but may have been dropped in the meantime.
+ * Return NULL on failure
+ */
+struct superblock * heap_add_superblock(const unsigned int seg_size_idx, const unsigned int heap_idx)
+{
+    unsigned int seg_size = SEG_SIZES[seg_size_idx];
 
-        large_list = NULL;
+    DEBUG(DB_MALLOC, "[heap_add_superblock] Looking for superblock in reclaimed superblocks...\n");
+    struct superblock* new_sb = find_reclaimed_superblock(heap_idx, seg_size);
 
-        pthread_mutexattr_t large_attrs;
-        pthread_mutexattr_init(&large_attrs);
-        pthread_mutex_init(&(large_lock), &large_attrs);
+    if (new_sb == NULL && (new_sb = steal_superblock(seg_size_idx, heap_idx)) != NULL) {
+        sb_bin_insert(new_sb, heap_idx);
+        return new_sb;
+    }
 
-        pthread_mutexattr_t sbrk_attrs;
-        pthread_mutexattr_init(&sbrk_attrs);
-        pthread_mutex_init(&(sbrk_lock), &sbrk_attrs);
+    // every so often, see if idle heaps are sitting on free superblocks
+    if (new_sb == NULL && __atomic_add_fetch(&heap_grows, 1, __ATOMIC_RELAXED) % HEAP_FOLD_INTERVAL == 0 &&
+            fold_idle_heaps(heap_idx) > 0) {
+        new_sb = find_reclaimed_superblock(heap_idx, seg_size);
+    }
 
+    if (new_sb == NULL) {
+        lock_release(&(heap[heap_idx].classes[seg_size_idx].lock));
+        DEBUG(DB_MALLOC, "[heap_add_superblock] No reclaimed superblocks. Creating a new one.\n");
+        new_sb = make_superblock(seg_size, heap_idx);
+        lock_acquire(&(heap[heap_idx].classes[seg_size_idx].lock));
 
-        DEBUG(DB_INIT, "[mm_init] at end: %p\n", TOP);
-        return result;
+        if (new_sb == NULL) {
+            DEBUG(DB_MALLOC, "[heap_add_superblock] Error: failed to create a new superblock\n");
+            return NULL;
+        }
+        heap_count(heap_idx, 0, 0, 1);
+    } else {
+        DEBUG(DB_MALLOC, "[heap_add_superblock] Managed to reclaim superblock\n");
     }
 
-    return 0;
+    assert(new_sb != NULL);
+
+    new_sb->heap_idx = heap_idx;
+    heap_count(heap_idx, 0, new_sb->max_segs, 0);
+
+    DEBUG(DB_MALLOC, "[heap_add_superblock] Adding newly created/reclaimed superblock to front of sb_list\n");
+    DEBUG(DB_MALLOC, "[heap_add_superblock] adding to heap with index: %d\n", heap_idx);
+
+    sb_bin_insert(new_sb, heap_idx);
+    return new_sb;
 }
 
+#if SB_FREE_TRACKING == SB_TRACK_BITMAP
 /**
- * Return the segment size needed to store the given size
- * Return value IS THE INDEX IN SEG_SIZES
- * Do not call this function with size > MAX_SEG (= SEG_SIZES[NUM_SEGS - 1])
+ * Slot of a segment in tcache_marks
  */
-unsigned int get_seg_size(const size_t size)
+static inline unsigned int tcache_mark(const void * addr)
 {
-    assert (size <= SEG_SIZES[NUM_SEGS - 1]);
-    int i;
-    for (i = 0; i < NUM_SEGS; i++) {
-        if (size <= SEG_SIZES[i]) {
-            return i;
-        }
-    }
+    return ((unsigned long) addr * 0x9e3779b97f4a7c15UL) >> (64 - TCACHE_MARK_BITS);
+}
 
-    // should always find matching seg size
-    assert(false);
-    return NUM_SEGS; // to suppress compiler warnings
+void tcache_push(struct tcache_bin * bin, void * addr)
+{
+    assert(bin->count < TCACHE_MAX_COUNT);
+    bin->slots[bin->count++] = addr;
+    tcache_marks[tcache_mark(addr)]++;
 }
 
-unsigned int get_heap_index()
+void * tcache_pop(struct tcache_bin * bin)
+{
+    assert(bin->count > 0);
+    void * addr = bin->slots[--bin->count];
+    tcache_marks[tcache_mark(addr)]--;
+    return addr;
+}
+#else
+void tcache_push(struct tcache_bin * bin, void * addr)
+{
+    struct freelist_node * node = make_freelist_node(addr);
+    node->next = bin->head;
+    bin->head = node;
+    bin->count++;
+}
+
+void * tcache_pop(struct tcache_bin * bin)
 {
-    return sched_getcpu() + 1;
+    assert(bin->head != NULL);
+    assert(bin->count > 0);
+
+    struct freelist_node * node = bin->head;
+    bin->head = node->next;
+    bin->count--;
+    return (void *) node;
 }
+#endif
 
 /**
- * Look for a free node in the given heap
- * If found, pop from parent superblock
- * Return address of the free node found, return NULL on failure
+ * Move up to count free segments from the given heap into a thread cache bin,
+ * taking them from the fullest superblocks that aren't full, so the emptier
+ * ones get a chance to drain and be reclaimed
+ * Must be called with the heap's lock for the class held
+ * Return the number of segments moved
  */
-void * find_free_node (const unsigned int seg_size_idx, const unsigned int heap_idx)
+unsigned int find_free_node (const unsigned int seg_size_idx, const unsigned int heap_idx,
+                             struct tcache_bin * bin, const unsigned int count)
 {
-    struct superblock * sb_list = heap[heap_idx].sb_map[seg_size_idx];
-    void * addr;
-
-    if (sb_list) {
-        DEBUG(DB_MALLOC, "[small_malloc] Superblock list is non-empty\n");
-        DEBUG(DB_MALLOC, "[small_malloc] Traversing through superblocks to find non-empty free list...\n");
-    } else {
-        DEBUG(DB_MALLOC, "[small_malloc] Superblock list is empty\n");
-    }
     struct superblock * sb;
-    for (sb = sb_list; sb != NULL; sb = sb->next) {
-        assert((void *) sb < TOP);
-        assert((void *) sb >= BOTTOM);
-        assert(sb != sb->next);
-
-        DEBUG(DB_FIND_FREESEG, "[small_malloc] Checking SB at address %p with seg_size %u for free space...\n", sb, sb->seg_size);
-        if (sb->free_count > 0) {
-            DEBUG(DB_MALLOC, "[small_malloc] Found non-empty freelist in superblock at %p\n", sb);
-            DEBUG(DB_MALLOC, "[small_malloc] before entering pop, freelist: %p\n", sb->freelist);
-            DEBUG(DB_MALLOC, "[small_malloc] before entering pop, free_count: %u\n", sb->free_count);
-
-            struct freelist_node * fl_node = sb_freelist_pop(sb);
-            assert (fl_node != NULL);
-
-            addr = (void *) fl_node;
-            // clear the node
-            memset(addr, EMPTY_MEM_CHAR, sb->seg_size);
-            heap[heap_idx].cur_f += 1;
-            return addr;
+    unsigned int taken = 0;
+    int b;
+
+    for (b = SB_FULLNESS_BINS - 1; b >= 0 && taken < count; b--) {
+        while (taken < count && (sb = heap[heap_idx].classes[seg_size_idx].bins[b]) != NULL) {
+            assert(region_holds(sb));
+            assert(sb->free_count > 0);
+
+            DEBUG(DB_FIND_FREESEG, "[find_free_node] Taking segments from SB at address %p in bin %d\n", sb, b);
+            while (sb->free_count > 0 && taken < count) {
+                tcache_push(bin, sb_freelist_pop(sb));
+                taken++;
+            }
+            // moves it out of bin b unless the batch is complete
+            sb_rebin(sb, heap_idx);
         }
     }
 
-    return NULL;
+    heap_count(heap_idx, taken, 0, 0);
+    return taken;
 }
 
 /**
- * Find a reclaimed superblock.
- * First look in own sb_freeelist, then in global heap's sb_freelist
- * Return NULL on failure
+ * Drain the remote freelists of the heap's superblocks that have been queued
+ * on its remote_sbs stack for the given class. Superblocks that turn out to
+ * be completely free are reclaimed, the others are moved to their new
+ * fullness bin.
+ * Must be called with the heap's lock for the class held
+ * Return the number of segments drained
  */
-void * find_reclaimed_superblock(const unsigned int heap_idx, const unsigned int seg_size)
+unsigned int heap_drain_remote (const unsigned int heap_idx, const unsigned int seg_size_idx)
 {
-    unsigned int seg_idx = get_seg_index(seg_size);
-    if (heap[heap_idx].sb_freelist) {
-        DEBUG(DB_MALLOC_TOPLVL, "[find_reclaimed_superblock] Found superblock %p in reclaimed superblocks for heap %u\n", heap[heap_idx].sb_freelist, heap_idx);
-        DEBUG(DB_MALLOC, "[find_reclaimed_superblock] Removing superblock from reclaimed superblocks\n");
-        struct superblock * new_sb = heap[heap_idx].sb_freelist;
-        heap[heap_idx].sb_freelist = new_sb->next;
-        if (new_sb->next)
-            heap[heap_idx].sb_freelist->prev = NULL;
+    struct superblock ** stack = &heap[heap_idx].remote_sbs[seg_size_idx];
+    if (__atomic_load_n(stack, __ATOMIC_RELAXED) == NULL) return 0;
+
+    struct superblock * sb = __atomic_exchange_n(stack, NULL, __ATOMIC_ACQUIRE);
+    struct superblock * next;
+    unsigned int drained = 0;
+
+    for (; sb != NULL; sb = next) {
+        next = sb->remote_next;
+        // from here on, a new remote free queues the superblock again
+        __atomic_store_n(&sb->remote_queued, false, __ATOMIC_SEQ_CST);
+
+        // emptied by heap_push_segment since it was queued; a superblock
+        // that's reclaimed has no remote frees, and gets queued again once
+        // it's back in use and has some
+        if (__atomic_load_n(&sb->reclaimed, __ATOMIC_ACQUIRE)) continue;
+
+        if (sb->heap_idx != heap_idx || get_seg_index(sb->seg_size) != seg_size_idx) {
+            // it changed owners, or was reclaimed and reused for another
+            // class, after it was queued; pass it on if it still needs it
+            if (__atomic_load_n(&sb->remote_freelist, __ATOMIC_SEQ_CST) != NULL &&
+                    !__atomic_exchange_n(&sb->remote_queued, true, __ATOMIC_SEQ_CST)) {
+                heap_queue_remote(__atomic_load_n(&sb->heap_idx, __ATOMIC_RELAXED), sb);
+            }
+            continue;
+        }
+
+        unsigned int n = sb_drain_remote(sb);
+        drained += n;
+        heap_count(heap_idx, -(int) n, 0, 0);
 
-        DEBUG(DB_MALLOC, "[find_reclaimed_superblock] Clearing reclaimed superblock\n");
-        clear_superblock(new_sb, seg_size);
+        if (sb->free_count == sb->max_segs) {
+            heap_count(heap_idx, 0, -(int) sb->max_segs, 0);
+            reclaim_superblock(sb, heap_idx, heap_idx);
+        } else {
+            sb_rebin(sb, heap_idx);
+        }
+    }
 
-        DEBUG(DB_MALLOC, "[find_reclaimed_superblock] Got back cleared superblock starting at %p, seg_size %u, free_count %u\n", new_sb, new_sb->seg_size, new_sb->free_count);
+    DEBUG(DB_REMOTE, "[heap_drain_remote] Drained %u remote frees for heap %u\n", drained, heap_idx);
+    return drained;
+}
 
-        DEBUG(DB_MALLOC, "[find_reclaimed_superblock] Clearing next and previous pointers for reclaimed superblock\n");
-        new_sb->next = NULL;
-        new_sb->prev = NULL;
+/**
+ * Return the maximum number of segments a thread may cache for a size class
+ */
+unsigned int tcache_limit(const unsigned int seg_size_idx)
+{
+    unsigned int limit = TCACHE_MAX_BYTES / SEG_SIZES[seg_size_idx];
+    if (limit > TCACHE_MAX_COUNT) return TCACHE_MAX_COUNT;
+    if (limit < TCACHE_MIN_COUNT) return TCACHE_MIN_COUNT;
+    return limit;
+}
 
-        DEBUG(DB_MALLOC_TOPLVL, "[find_reclaimed_superblock] freelist now points to %p\n",heap[heap_idx].sb_freelist);
-        return (void *) new_sb;
-    } else if (heap[0].sb_freelist != NULL) {
-        pthread_mutex_lock(&(heap[0].heap_lock));
-        if (heap[0].sb_freelist != NULL) {
-            DEBUG(DB_MALLOC, "[find_reclaimed_superblock] Found superblock in reclaimed superblocks in global heap\n");
-            DEBUG(DB_MALLOC, "[find_reclaimed_superblock] Removing superblock from reclaimed superblocks\n");
-            struct superblock * new_sb = heap[0].sb_freelist;
-            heap[0].sb_freelist = new_sb->next;
-            if (new_sb->next)
-                heap[0].sb_freelist -> prev = NULL;
-
-            DEBUG(DB_MALLOC, "[find_reclaimed_superblock] Clearing reclaimed superblock\n");
-            clear_superblock(new_sb, seg_size);
-            DEBUG(DB_MALLOC, "[find_reclaimed_superblock] Got back cleared superblock starting at %p, seg_size %u, free_count %u\n", new_sb, new_sb->seg_size, new_sb->free_count);
-            DEBUG(DB_MALLOC, "[find_reclaimed_superblock] Clearing next and previous pointers for reclaimed superblock\n");
-            new_sb->next = NULL;
-            new_sb->prev = NULL;
-            pthread_mutex_unlock(&(heap[0].heap_lock));
-            return (void *) new_sb;
-        } 
-        pthread_mutex_unlock(&(heap[0].heap_lock));
+/**
+ * Fill a bin with a batch of segments of the given size class from the
+ * current CPU's heap, taking the heap's lock for the class once for the
+ * whole batch
+ */
+void heap_refill_bin(const unsigned int seg_size_idx, struct tcache_bin * bin, const unsigned int batch)
+{
+    unsigned int heap_idx = get_heap_index();
+
+    class_lock_acquire(heap_idx, seg_size_idx);
+    __atomic_add_fetch(&heap[heap_idx].ops, 1, __ATOMIC_RELAXED);
+    if (find_free_node(seg_size_idx, heap_idx, bin, batch) == 0) {
+        DEBUG(DB_MALLOC, "[heap_refill_bin] No non-empty freelists found.\n");
+
+        // segments other threads freed to us are only picked up on a miss
+        if (heap_drain_remote(heap_idx, seg_size_idx) == 0 ||
+                find_free_node(seg_size_idx, heap_idx, bin, batch) == 0) {
+            if (heap_add_superblock(seg_size_idx, heap_idx) != NULL) {
+                find_free_node(seg_size_idx, heap_idx, bin, batch);
+            }
+        }
     }
-    return NULL;
+    lock_release(&(heap[heap_idx].classes[seg_size_idx].lock));
+
+    DEBUG(DB_TCACHE, "[heap_refill_bin] Refilled class %u with %u segments\n", seg_size_idx, bin->count);
 }
 
 /**
- * Allocate memory for sizes <= SB_SIZE / 2
+ * Fill this thread's cache for the given size class from the current CPU's heap
  */
-void * small_malloc(const size_t size)
+void tcache_refill(const unsigned int seg_size_idx)
 {
-    int heap_idx = get_heap_index();
+    if (!tcache_registered) {
+        // any non-NULL value will make the key's destructor run on thread exit
+        pthread_setspecific(tcache_key, tcache);
+        tcache_registered = true;
+    }
 
-    DEBUG(DB_MALLOC, "[small_malloc] malloc to heap index: %d\n", heap_idx);
+    heap_refill_bin(seg_size_idx, &tcache[seg_size_idx], tcache_limit(seg_size_idx) / 2);
+}
 
-    unsigned int seg_size_idx = get_seg_size(size);
-    assert (seg_size_idx < NUM_SEGS);
-    unsigned int seg_size = SEG_SIZES[seg_size_idx];
+//////////////////////////////// PER-CPU CACHES ////////////////////////////////
+// The kernel keeps the id of the CPU a thread is running on in the thread's
+// struct rseq, and aborts a registered critical section if the thread is
+// preempted, migrated or signalled before the section's final store. So a
+// cache per CPU can be popped and pushed with plain loads and stores: no lock
+// and no atomic read-modify-write. A critical section that aborts jumps back
+// to C, which starts over on whatever CPU the thread is on by then.
+// Threads without an rseq registration, on a CPU we have no cache for, or
+// bound to a heap of their own use their thread cache instead.
+#if A2ALLOC_RSEQ
 
-    DEBUG(DB_MALLOC, "[small_malloc] Finding superblock linked list with seg size %d\n", seg_size);
+/**
+ * One CPU's cache: count[i] segments of class i sit in slots[i][0..count[i])
+ * Only ever changed inside rseq critical sections running on that CPU
+ */
+struct cpu_cache {
+    unsigned long count[NUM_SEGS];
+    void * slots[NUM_SEGS][TCACHE_MAX_COUNT];
+} __attribute__((aligned(64)));
+
+static struct cpu_cache * cpu_caches = NULL;
+static unsigned int cpu_cache_count = 0;
+
+#define RSEQ_STR_1(x)       #x
+#define RSEQ_STR(x)         RSEQ_STR_1(x)
+
+// Start a critical section running from label 1 up to label 2: describe it
+// in a struct rseq_cs, point the thread's rseq_cs at it, and abort if we
+// aren't on the CPU the caller looked up.
+#define RSEQ_CS_BEGIN                                                   \
+    ".pushsection __rseq_cs, \"aw\"\n\t"                                \
+    ".balign 32\n\t"                                                    \
+    "3:\n\t"                                                            \
+    ".long 0, 0\n\t"                                                    \
+    ".quad 1f, (2f - 1f), 4f\n\t"                                       \
+    ".popsection\n\t"                                                   \
+    "leaq 3b(%%rip), %%rax\n\t"                                         \
+    "movq %%rax, %[rseq_cs]\n\t"                                        \
+    "1:\n\t"                                                            \
+    "cmpl %[cpu], %[cpu_id]\n\t"                                        \
+    "jnz 4f\n\t"
+
+// End it; the abort handler must come right after the signature glibc
+// registered the thread with
+#define RSEQ_CS_END(abort_label)                                        \
+    "2:\n\t"                                                            \
+    ".pushsection __rseq_failure, \"ax\"\n\t"                           \
+    ".byte 0x0f, 0xb9, 0x3d\n\t"                                        \
+    ".long " RSEQ_STR(RSEQ_SIG) "\n\t"                                  \
+    "4:\n\t"                                                            \
+    "jmp %l[" #abort_label "]\n\t"                                      \
+    ".popsection\n\t"
+
+static inline struct rseq * rseq_area(void)
+{
+    return (struct rseq *) ((char *) __builtin_thread_pointer() + __rseq_offset);
+}
 
-    // now, we know which sb_list we want
-    // go through each superblock and see if there is anything in the freelists
-    void * start_addr = NULL;
-    DEBUG(DB_MALLOC_TOPLVL, "[small_malloc] about to enter FIND_FREE_NODE\n");
-    pthread_mutex_lock(&(heap[heap_idx].heap_lock));
-    start_addr = find_free_node(seg_size_idx, heap_idx);
-    if (start_addr != NULL) {
-        // found memory in freelist
+/**
+ * Return the CPU this thread is running on, or -1 if it can't use the
+ * per-CPU caches. Threads pinned with a2alloc_bind_heap can't: the caches
+ * would hand them segments of the CPU's heap, not of the one they chose
+ */
+static inline int rseq_cpu(void)
+{
+    if (thread_heap_bound) return -1;
+    // negative while the thread isn't registered; cpu_cache_count is 0 if
+    // glibc doesn't do rseq at all
+    int cpu = (int) __atomic_load_n(&rseq_area()->cpu_id, __ATOMIC_RELAXED);
+    if (cpu < 0 || (unsigned int) cpu >= cpu_cache_count) return -1;
+    return cpu;
+}
 
-        pthread_mutex_unlock(&(heap[heap_idx].heap_lock));
-        return start_addr;
+/**
+ * Pop a segment of the given class off this CPU's cache into *addr
+ * Return 1 on success, 0 if the cache is empty, -1 if this thread can't use
+ * the per-CPU caches
+ */
+static inline int cpu_cache_pop(const unsigned int seg_size_idx, void ** addr)
+{
+    struct rseq * rs = rseq_area();
+
+    for (;;) {
+        int cpu = rseq_cpu();
+        if (cpu < 0) return -1;
+        struct cpu_cache * cc = &cpu_caches[cpu];
+
+        __asm__ goto (
+            RSEQ_CS_BEGIN
+            "movq (%[count]), %%rbx\n\t"
+            "testq %%rbx, %%rbx\n\t"
+            "jz %l[empty]\n\t"
+            "subq $1, %%rbx\n\t"
+            "movq (%[slots], %%rbx, 8), %%rcx\n\t"
+            "movq %%rcx, (%[addr])\n\t"
+            // commit
+            "movq %%rbx, (%[count])\n\t"
+            RSEQ_CS_END(abort)
+            :
+            : [cpu] "r" (cpu), [cpu_id] "m" (rs->cpu_id), [rseq_cs] "m" (rs->rseq_cs),
+              [count] "r" (&cc->count[seg_size_idx]), [slots] "r" (cc->slots[seg_size_idx]),
+              [addr] "r" (addr)
+            : "memory", "cc", "rax", "rbx", "rcx"
+            : abort, empty);
+        return 1;
+empty:
+        return 0;
+abort:
+        DEBUG(DB_TCACHE, "[cpu_cache_pop] Restarting after an rseq abort\n");
     }
+}
 
-    DEBUG(DB_MALLOC, "[small_malloc] No non-empty freelists found.\n");
-    DEBUG(DB_MALLOC, "[small_malloc] Looking for superblock in reclaimed superblocks...\n");
-    struct superblock* new_sb = find_reclaimed_superblock(heap_idx, seg_size);
+/**
+ * Push a segment of the given class onto this CPU's cache, if it holds
+ * fewer than limit of them
+ * Return 1 on success, 0 if the cache is full, -1 if this thread can't use
+ * the per-CPU caches
+ */
+static inline int cpu_cache_push(const unsigned int seg_size_idx, void * addr, const unsigned long limit)
+{
+    struct rseq * rs = rseq_area();
+
+    for (;;) {
+        int cpu = rseq_cpu();
+        if (cpu < 0) return -1;
+        struct cpu_cache * cc = &cpu_caches[cpu];
+
+        __asm__ goto (
+            RSEQ_CS_BEGIN
+            "movq (%[count]), %%rbx\n\t"
+            "cmpq %[limit], %%rbx\n\t"
+            "jae %l[full]\n\t"
+            "movq %[addr], (%[slots], %%rbx, 8)\n\t"
+            "addq $1, %%rbx\n\t"
+            // commit
+            "movq %%rbx, (%[count])\n\t"
+            RSEQ_CS_END(abort)
+            :
+            : [cpu] "r" (cpu), [cpu_id] "m" (rs->cpu_id), [rseq_cs] "m" (rs->rseq_cs),
+              [count] "r" (&cc->count[seg_size_idx]), [slots] "r" (cc->slots[seg_size_idx]),
+              [addr] "r" (addr), [limit] "r" (limit)
+            : "memory", "cc", "rax", "rbx"
+            : abort, full);
+        return 1;
+full:
+        return 0;
+abort:
+        DEBUG(DB_TCACHE, "[cpu_cache_push] Restarting after an rseq abort\n");
+    }
+}
 
-    if (new_sb == NULL) {
-        pthread_mutex_unlock(&(heap[heap_idx].heap_lock));
-        DEBUG(DB_MALLOC, "[small_malloc] No reclaimed superblocks. Creating a new one.\n");
-        new_sb = make_superblock(seg_size);
+#if SB_FREE_TRACKING == SB_TRACK_BITMAP
+/**
+ * Return whether this CPU's cache holds the segment
+ * Scanned outside any critical section, so other threads on this CPU may
+ * push and pop meanwhile; they only ever store segments that are free, so
+ * a segment the caller owns is never found, and one freed twice may be
+ * missed if we're migrated
+ */
+static bool cpu_cache_holds(const unsigned int seg_size_idx, void * addr)
+{
+    int cpu = rseq_cpu();
+    if (cpu < 0) return false;
+    struct cpu_cache * cc = &cpu_caches[cpu];
+
+    unsigned long count = __atomic_load_n(&cc->count[seg_size_idx], __ATOMIC_ACQUIRE);
+    unsigned long i;
+    for (i = 0; i < count && i < TCACHE_MAX_COUNT; i++) {
+        if (__atomic_load_n(&cc->slots[seg_size_idx][i], __ATOMIC_RELAXED) == addr) return true;
+    }
+    return false;
+}
+#endif
 
-        if (new_sb == NULL) {
-            DEBUG(DB_MALLOC, "[small_malloc] Error: failed to create a new superblock\n");
-            return NULL;
+/**
+ * Refill this CPU's cache for the given class from the current CPU's heap
+ * Return one of the segments, or NULL if there was no memory
+ */
+void * cpu_cache_refill(const unsigned int seg_size_idx)
+{
+    struct tcache_bin local = { .count = 0 };
+    unsigned int limit = tcache_limit(seg_size_idx);
+
+    heap_refill_bin(seg_size_idx, &local, limit / 2);
+    if (local.count == 0) return NULL;
+
+    void * addr = tcache_pop(&local);
+    while (local.count > 0) {
+        void * seg = tcache_pop(&local);
+        if (cpu_cache_push(seg_size_idx, seg, limit) != 1) {
+            // we moved to a CPU whose cache is already full: give the rest back
+            tcache_push(&local, seg);
+            heap_flush_bin(seg_size_idx, &local, local.count);
+            break;
         }
-        pthread_mutex_lock(&(heap[heap_idx].heap_lock));
-    } else {
-        DEBUG(DB_MALLOC, "[small_malloc] Managed to reclaim superblock\n");
     }
+    return addr;
+}
 
-    assert(new_sb != NULL);
+/**
+ * Give half of this CPU's cache for the given class back to the heaps
+ */
+void cpu_cache_flush(const unsigned int seg_size_idx)
+{
+    struct tcache_bin local = { .count = 0 };
+    unsigned int count = tcache_limit(seg_size_idx) / 2;
+    void * seg;
 
-    new_sb->heap_idx = heap_idx;
-    heap[heap_idx].total_f += new_sb->max_segs;
-    heap[heap_idx].cur_k += 1;
+    while (count > 0 && cpu_cache_pop(seg_size_idx, &seg) == 1) {
+        tcache_push(&local, seg);
+        count--;
+    }
+    heap_flush_bin(seg_size_idx, &local, local.count);
+}
+
+/**
+ * Set up a cache for each CPU, unless rseq isn't available
+ */
+void cpu_caches_init(const unsigned int cpu_count)
+{
+    if (__rseq_size == 0) return;
 
-    DEBUG(DB_MALLOC, "[small_malloc] Adding newly created/reclaimed superblock to front of sb_list\n");
-    DEBUG(DB_MALLOC, "[small_malloc] adding to heap with index: %d\n", heap_idx);
+    void * mem = mmap(NULL, cpu_count * sizeof (struct cpu_cache), PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+        fprintf(stderr, "[cpu_caches_init] mmap failed, using thread caches only\n");
+        return;
+    }
+    cpu_caches = mem;
+    cpu_cache_count = cpu_count;
+}
+#endif
+
+/**
+ * Allocate memory for sizes <= SB_SIZE / 2
+ */
+void * small_malloc(const size_t size)
+{
+    unsigned int seg_size_idx = get_seg_size(size);
+    assert (seg_size_idx < NUM_SEGS);
+    struct tcache_bin * bin = &tcache[seg_size_idx];
 
-    insert_sb_in_front(new_sb, heap_idx, seg_size_idx);
+    void * start_addr;
 
-    DEBUG(DB_MALLOC, "[small_malloc] Taking off node from new superblock's freelist...\n");
-    DEBUG(DB_MALLOC, "[small_malloc] before entering pop, freelist: %p\n", new_sb->freelist);
-    DEBUG(DB_MALLOC, "[small_malloc] before entering pop, free_count: %u\n", new_sb->free_count);
+#if A2ALLOC_RSEQ
+    int popped = cpu_cache_pop(seg_size_idx, &start_addr);
+    if (popped == 0) {
+        start_addr = cpu_cache_refill(seg_size_idx);
+        if (start_addr == NULL) {
+            DEBUG(DB_MALLOC, "[small_malloc] Error: failed to refill CPU cache\n");
+            return NULL;
+        }
+    }
+    if (popped < 0)
+#endif
+    {
+        DEBUG(DB_MALLOC, "[small_malloc] malloc from thread cache for class %u\n", seg_size_idx);
 
-    assert(new_sb->freelist != NULL);
-    struct freelist_node * fl_node = sb_freelist_pop(new_sb);
+        if (bin->count == 0) {
+            tcache_refill(seg_size_idx);
 
-    heap[heap_idx].cur_f += 1;
-    DEBUG(DB_MALLOC_TOPLVL, "[small_malloc] after pop, free_list points to: %p\n", new_sb->freelist);
-    DEBUG(DB_MALLOC, "[small_malloc] Got freelist node with starting address %p and segment size %u\n", fl_node, new_sb->seg_size);
-    pthread_mutex_unlock(&(heap[heap_idx].heap_lock));
+            if (bin->count == 0) {
+                DEBUG(DB_MALLOC, "[small_malloc] Error: failed to refill thread cache\n");
+                return NULL;
+            }
+        }
+        start_addr = tcache_pop(bin);
+    }
 
-    start_addr = (void *) fl_node;
-    assert(start_addr != NULL);
-    memset(start_addr, EMPTY_MEM_CHAR, new_sb->seg_size);
+    if (A2ALLOC_POISON & POISON_ON_ALLOC) {
+        memset(start_addr, EMPTY_MEM_CHAR, SEG_SIZES[seg_size_idx]);
+    }
     DEBUG(DB_MALLOC, "[small_malloc] Returning address %p\n", start_addr);
-    
+
     return start_addr;
 }
 
@@ -685,25 +3015,26 @@ void * small_malloc(const size_t size)
  */
 void * mm_malloc(size_t size)
 {
-    if(BOTTOM && TOP) {
-        assert(TOP > BOTTOM);
-        assert((TOP - BOTTOM) % SB_SIZE == 0);
-    }
-
     DEBUG(DB_MALLOC_TOPLVL, "[mm_malloc] Trying to allocate memory chunk of size %lu\n", size);
 
     if (size == 0) {
-        // as a debugging measure, return TOP when size 0 requested
-        return TOP;
+        // as a debugging measure, return how far the heaps have grown when
+        // size 0 is requested. They grow in regions of their own, so there's
+        // no single top to point at: this is the bytes all of them took as
+        // an offset from NULL, so that two calls are apart by how much the
+        // heaps grew in between, whichever CPU the caller ran on
+        return (void *) __atomic_load_n(&heap_grown, __ATOMIC_RELAXED);
     }
 
-    if (size > SB_SIZE / 2) {
+    if (size > MAX_SEG) {
         DEBUG(DB_MALLOC_TOPLVL, "[mm_malloc] allocating for size greater than SB_SIZE/2\n");
-        pthread_mutex_lock(&large_lock);
-        struct largeblock * lb = make_largeblock(TOP, size);
-        void * addr = (void *)lb + sizeof(struct largeblock);
-        pthread_mutex_unlock(&large_lock);
-        return addr;
+        struct largeblock * lb = size >= A2ALLOC_MMAP_THRESHOLD || size > REGION_BLOCK_MAX - sizeof(struct largeblock) ?
+                                 make_hugeblock(size) : make_largeblock(size);
+        if (lb == NULL) return NULL;
+        if (A2ALLOC_POISON & POISON_ON_ALLOC) {
+            memset((void *)lb + sizeof(struct largeblock), EMPTY_MEM_CHAR, size);
+        }
+        return (void *)lb + sizeof(struct largeblock);
     } else {
         DEBUG(DB_MALLOC_TOPLVL, "[mm_malloc] allocating for size <= SB_SIZE / 2\n");
         void * addr = small_malloc(size);
@@ -712,111 +3043,376 @@ void * mm_malloc(size_t size)
     }
 }
 
-void init_largeblock_to_superblock(struct superblock *sb)
+/**
+ * Allocate zeroed memory for nmemb elements of the given size
+ * Return NULL if the total size overflows
+ */
+void * mm_calloc(size_t nmemb, size_t size)
 {
-    sb->seg_size = 0; // clear superblock needs this to check if this is a newly reclaimed guy
-    sb->freelist = NULL;
-    sb->next = NULL;
-    sb->prev = NULL;
-    sb->reclaimed = true;
+    if (size != 0 && nmemb > (size_t) -1 / size) {
+        DEBUG(DB_MALLOC_TOPLVL, "[mm_calloc] %lu elements of size %lu overflow\n", nmemb, size);
+        return NULL;
+    }
+
+    size_t bytes = nmemb * size;
+    void * addr = mm_malloc(bytes);
+    // the only place the allocator zeroes memory for its caller; huge blocks
+    // are fresh anonymous mappings, which the kernel has zeroed already
+    if (addr != NULL && bytes != 0 &&
+        (bytes < A2ALLOC_MMAP_THRESHOLD || (A2ALLOC_POISON & POISON_ON_ALLOC))) {
+        memset(addr, 0, bytes);
+    }
+    return addr;
 }
 
+/**
+ * Resize the block at addr to size bytes, keeping its contents up to the
+ * smaller of the two sizes. Blocks that still fit stay where they are, huge
+ * blocks that stay huge are remapped, anything else is moved to a new block
+ */
+void * mm_realloc(void * addr, size_t size)
+{
+    DEBUG(DB_MALLOC_TOPLVL, "[mm_realloc] Resizing %p to %lu bytes\n", addr, size);
+    if (addr == NULL) return mm_malloc(size);
+    if (size == 0) {
+        mm_free(addr);
+        return NULL;
+    }
 
-void free_large (void * addr, struct largeblock * lb)
+    struct page_info * info = pagemap_lookup(addr);
+    assert(info != NULL);
+
+    size_t usable;
+    if (info->kind == PAGE_HUGE) {
+        struct largeblock * lb = (struct largeblock *) info->hdr;
+        if (size >= A2ALLOC_MMAP_THRESHOLD) {
+            struct largeblock * remapped = remap_hugeblock(lb, size);
+            if (remapped != NULL) return (void *)remapped + sizeof(struct largeblock);
+        }
+        usable = ((size_t) lb->size << PAGE_SHIFT) - sizeof(struct largeblock);
+    } else if (info->kind == PAGE_LARGE) {
+        struct largeblock * lb = (struct largeblock *) info->hdr;
+        usable = (size_t) lb->size * SB_SIZE - sizeof(struct largeblock);
+        if (size <= usable && size > MAX_SEG) return addr;
+    } else {
+        assert(info->kind == PAGE_SMALL);
+        usable = SEG_SIZES[info->seg_idx];
+        if (size <= usable) return addr;
+    }
+
+    void * moved = mm_malloc(size);
+    if (moved == NULL) return NULL;
+    memcpy(moved, addr, size < usable ? size : usable);
+    mm_free(addr);
+    return moved;
+}
+
+/**
+ * Name of the heap policy this allocator was built with
+ */
+const char * a2alloc_heap_policy(void)
 {
+    return A2ALLOC_HEAP_POLICY == HEAP_POLICY_THREAD ? "thread" : "cpu";
+}
 
-    if (lb->prev != NULL)
-        lb->prev->next = lb->next;
-    if (lb->next != NULL)
-        lb->next->prev = lb->prev;
-    if (large_list == lb) {
-        large_list = lb->next;
+/**
+ * Name of the kind of lock this allocator was built with
+ */
+const char * a2alloc_lock_kind(void)
+{
+    switch (A2ALLOC_LOCK) {
+    case LOCK_ADAPTIVE: return "adaptive";
+    case LOCK_TICKET:   return "ticket";
+    default:            return "pthread";
     }
+}
 
-    lb->next = NULL;
-    lb->prev = NULL;
+#if A2ALLOC_LOCK_STATS
+void print_lock(FILE * f, const char * name, struct alloc_lock * lock)
+{
+    if (lock->acquired == 0) return;
+    fprintf(f, "a2alloc lock %-20s acquired %lu, waited %lu times for %lu cycles\n",
+            name, lock->acquired, lock->contended, lock->wait_cycles);
+}
 
-    //convert the freed space to superblocks and append to sb_freelist
-    unsigned int span = lb->size;
-    DEBUG(DB_FREE, "[free_large] lb size is: %u\n", lb->size);
-    struct superblock * partition;
-    pthread_mutex_lock(&(heap[0].heap_lock));
-    int i;
-    for (i = 0; i < span; i++) {
-        partition = (struct superblock *) (((void*) lb) + (SB_SIZE * i));
-        partition->seg_size = 0;
-        init_largeblock_to_superblock(partition);
-        clear_superblock(partition, 16);
-        reclaim_superblock(partition, 0, 0);
+/**
+ * Print the counters of every lock that has been taken
+ */
+void a2alloc_print_locks(FILE * f)
+{
+    char name[32];
+    unsigned int made = __atomic_load_n(&heaps_made, __ATOMIC_ACQUIRE);
+    unsigned int idx, i;
+
+    print_lock(f, "pagemap", &pagemap_lock);
+    print_lock(f, "heap directory", &heap_dir_lock);
+    for (idx = 1; idx <= made; idx++) {
+        snprintf(name, sizeof name, "heap %u", idx);
+        print_lock(f, name, &heap[idx].heap_lock);
+        snprintf(name, sizeof name, "heap %u grow", idx);
+        print_lock(f, name, &heap[idx].grow_lock);
+        for (i = 0; i < NUM_SEGS; i++) {
+            snprintf(name, sizeof name, "heap %u class %u", idx, SEG_SIZES[i]);
+            print_lock(f, name, &heap[idx].classes[i].lock);
+        }
     }
-    pthread_mutex_unlock(&(heap[0].heap_lock));
 }
+#endif
 
 /**
- * Examine this heap to check for SBs to move to heap 0
- * If the heap threshold is higher than F, do nothing.
+ * Name of the poisoning mode this allocator was built with
  */
-void maybe_move_to_heap_zero(const int heap_idx)
+const char * a2alloc_poison_mode(void)
 {
-    float heapThreshold = 1.0 * heap[heap_idx].cur_f / heap[heap_idx].total_f;
+    switch (A2ALLOC_POISON) {
+    case POISON_ON_ALLOC: return "alloc";
+    case POISON_ON_FREE:  return "free";
+    case POISON_DEBUG:    return "alloc+free";
+    default:              return "none";
+    }
+}
 
-    if (heapThreshold < F_thresh && heap[heap_idx].cur_k > K_thresh && heap_idx != 0) {
-  
-        if (heap[heap_idx].sb_freelist != NULL) {
-            pthread_mutex_lock(&(heap[0].heap_lock));
-            heap[heap_idx].cur_k--;
-            reclaim_superblock(heap[heap_idx].sb_freelist, heap_idx, 0);
-            pthread_mutex_unlock(&(heap[0].heap_lock));
-        }
+void free_large (void * addr, struct largeblock * lb)
+{
+    assert(addr == (void *)lb + sizeof(struct largeblock));
+    if (A2ALLOC_POISON & POISON_ON_FREE) {
+        memset(addr, FREED_MEM_CHAR, lb->size * SB_SIZE - sizeof(struct largeblock));
     }
+
+    // the pages stay a span until a large block or a superblock needs them
+    DEBUG(DB_FREE, "[free_large] lb size is: %u\n", lb->size);
+    span_free(lb, lb->size);
 }
 
-void free_small (void * addr)
+/**
+ * Give up to max of the heap's reclaimed superblocks away, biggest first,
+ * as long as it keeps more than keep_k superblocks. Each size goes as one
+ * chain to the LLC heap above, or to heap 0 if to_global is set.
+ * Must be called with heap_lock held
+ * Return the number of superblocks given away
+ */
+unsigned int heap_give_reclaimed(const int heap_idx, const unsigned int max, const unsigned int keep_k, const bool to_global)
 {
-    assert(addr < TOP);
-    assert(addr >= BOTTOM);
+    unsigned int moved = 0;
+    int size_idx;
+    for (size_idx = NUM_SB_SIZES - 1; size_idx >= 0 && moved < max; size_idx--) {
+        struct superblock * first = NULL;
+        struct superblock * last = NULL;
+        struct superblock * sb;
+        unsigned int moved_size = moved;
+
+        while (moved < max && __atomic_load_n(&heap[heap_idx].cur_k, __ATOMIC_RELAXED) > keep_k &&
+               (sb = heap[heap_idx].sb_freelist[size_idx]) != NULL) {
+            sb_list_remove(&heap[heap_idx].sb_freelist[size_idx], sb);
+            assert(sb->reclaimed);
+            sb->heap_idx = 0;
+            sb->next = first;
+            if (last == NULL) last = sb;
+            first = sb;
+            heap_count(heap_idx, 0, 0, -1);
+            moved++;
+        }
 
-    struct superblock * sb = get_sb(addr);
-    assert(sb != NULL);
-    assert((void *)sb >= BOTTOM);
-    assert((void *)sb < TOP);
+        if (first == NULL) continue;
+        if (to_global) {
+            sb_stack_push_chain(global_sb_stack, first, last);
+        } else {
+            move_up_tier(heap_idx, first, last, moved - moved_size);
+        }
+    }
+    return moved;
+}
 
-    //a thread can free address currently on another heap
-    int heap_idx = sb->heap_idx;
+/**
+ * Examine this heap to check for SBs to move to the next tier
+ * If the heap threshold is higher than F, do nothing. Otherwise give back up
+ * to SB_TRANSFER_BATCH reclaimed superblocks, pushing each size onto the LLC
+ * heap (or heap 0) as one chain.
+ * Must not be called with heap_lock held
+ */
+void maybe_move_up_tier(const int heap_idx)
+{
+    if (heap_idx == 0) return;
+
+    float heapThreshold = 1.0 * __atomic_load_n(&heap[heap_idx].cur_f, __ATOMIC_RELAXED) /
+                          __atomic_load_n(&heap[heap_idx].total_f, __ATOMIC_RELAXED);
+    if (heapThreshold >= F_thresh) return;
+    // nothing to give
+    if (__atomic_load_n(&heap[heap_idx].cur_k, __ATOMIC_RELAXED) <= K_thresh) return;
+
+    lock_acquire(&(heap[heap_idx].heap_lock));
+    unsigned int moved = heap_give_reclaimed(heap_idx, SB_TRANSFER_BATCH, K_thresh, false);
+    lock_release(&(heap[heap_idx].heap_lock));
+    DEBUG(DB_FREE, "[maybe_move_up_tier] Heap %d gave %u superblocks to the next tier\n", heap_idx, moved);
+}
 
-    pthread_mutex_lock(&(heap[heap_idx].heap_lock));
+/**
+ * Return a segment to its superblock
+ * Must be called with the owning heap's lock for the superblock's class held
+ */
+void heap_push_segment (void * addr, struct superblock * sb)
+{
+    int heap_idx = sb->heap_idx;
 
-    DEBUG(DB_FREE, "[free_small] Heap index is %d\n", heap_idx);
-    DEBUG(DB_FREE, "[free_small] Found relevant superblock. It has starting address %p and segment size %u\n", sb, sb->seg_size);
+    DEBUG(DB_FREE, "[heap_push_segment] Heap index is %d\n", heap_idx);
+    DEBUG(DB_FREE, "[heap_push_segment] Found relevant superblock. It has starting address %p and segment size %u\n", sb, sb->seg_size);
 
-    // create a new freelist node for this segment
-    struct freelist_node* node = make_freelist_node(addr);
+    // sb_freelist_push links the node in itself (or only sets a bit), so
+    // there's no need to write to the segment here
+    struct freelist_node* node = (struct freelist_node *) addr;
     assert(node != NULL);
-    unsigned int seg_idx = get_seg_index(sb->seg_size);
-    assert((void *) node >= BOTTOM);
-    assert((void *) node < TOP);
+    assert(region_holds(node));
 
-    DEBUG(DB_FREE, "[free_small] Created new freelist node at address %p of size %u\n", addr, sb->seg_size);
+    DEBUG(DB_FREE, "[heap_push_segment] Created new freelist node at address %p of size %u\n", addr, sb->seg_size);
     // add the freelist node to front of superblock's freelist
     sb_freelist_push(sb, node);
-    heap[heap_idx].cur_f--;
+
+    // we have the superblock in hand, so pick up any remote frees too;
+    // otherwise it could never be found completely free here
+    heap_count(heap_idx, -1 - (int) sb_drain_remote(sb), 0, 0);
 
     if (sb->free_count == sb->max_segs) {
-        heap[heap_idx].total_f -= sb->max_segs;
-        heap[heap_idx].cur_f -= sb->max_segs - sb->free_count;
+        heap_count(heap_idx, 0, -(int) sb->max_segs, 0);
         reclaim_superblock(sb, heap_idx, heap_idx);
     } else {
-        DEBUG(DB_FREE, "[free_small] Not reclaiming this block\n");
-        DEBUG(DB_FREE, "[free_small] free_count=%u\n", sb->free_count);
+        DEBUG(DB_FREE, "[heap_push_segment] Not reclaiming this block\n");
+        DEBUG(DB_FREE, "[heap_push_segment] free_count=%u\n", sb->free_count);
+
+        // it may have become empty enough for a lower bin
+        sb_rebin(sb, heap_idx);
+    }
+}
+
+/**
+ * Return up to count segments from a bin.
+ * Segments of superblocks owned by the current CPU's heap go straight back
+ * under one acquisition of its lock for the class; the rest are pushed onto
+ * their superblocks' remote freelists without touching the owners' locks.
+ */
+void heap_flush_bin(const unsigned int seg_size_idx, struct tcache_bin * bin, unsigned int count)
+{
+    unsigned int heap_idx = get_heap_index();
+    unsigned int remote = 0;
+
+    DEBUG(DB_TCACHE, "[heap_flush_bin] Flushing %u of %u segments of class %u\n", count, bin->count, seg_size_idx);
+
+    class_lock_acquire(heap_idx, seg_size_idx);
+    __atomic_add_fetch(&heap[heap_idx].ops, 1, __ATOMIC_RELAXED);
+    while (count > 0 && bin->count > 0) {
+        void * addr = tcache_pop(bin);
+        struct superblock * sb = get_sb(addr);
+
+        // a thread can free address currently on another heap
+        // we hold our own heap's lock for the class, so this can't change
+        // under us if it's ours
+        if (sb->heap_idx == heap_idx) {
+            heap_push_segment(addr, sb);
+        } else {
+            sb_remote_push(sb, addr);
+            remote++;
+        }
+        count--;
+    }
+
+    lock_release(&(heap[heap_idx].classes[seg_size_idx].lock));
+    maybe_move_up_tier(heap_idx);
+
+    DEBUG(DB_REMOTE, "[heap_flush_bin] %u segments went to remote freelists\n", remote);
+}
+
+/**
+ * Return up to count segments from this thread's cache
+ */
+void tcache_flush(const unsigned int seg_size_idx, unsigned int count)
+{
+    heap_flush_bin(seg_size_idx, &tcache[seg_size_idx], count);
+}
 
-        // this SB has some nodes in freelist, so move to front of sb_map
-        // that way, should be very fast to find new freelist nodes
-        insert_sb_in_front(sb, heap_idx, seg_idx);
+/**
+ * Destructor for tcache_key: give everything in the exiting thread's cache
+ * back to the heaps
+ */
+void tcache_destroy(void * unused)
+{
+    unsigned int i;
+    for (i = 0; i < NUM_SEGS; i++) {
+        tcache_flush(i, tcache[i].count);
+    }
+    tcache_registered = false;
+
+    if (thread_heap != 0) {
+        __atomic_sub_fetch(&heap[thread_heap].threads, 1, __ATOMIC_RELAXED);
+        thread_heap = 0;
+        thread_heap_bound = false;
+    }
+}
+
+#if SB_FREE_TRACKING == SB_TRACK_BITMAP
+/**
+ * Abort if a segment about to be freed is already free: marked so in its
+ * superblock, or sitting in this thread's cache or this CPU's. Segments on
+ * a remote freelist or in another thread's cache aren't looked for
+ */
+void check_double_free(struct superblock * sb, const unsigned int seg_idx, void * addr)
+{
+    struct tcache_bin * bin = &tcache[seg_idx];
+    bool twice = sb_segment_free(sb, seg_idx, addr);
+    unsigned int i;
+
+    if (tcache_marks[tcache_mark(addr)] != 0) {
+        for (i = 0; !twice && i < bin->count; i++) {
+            twice = bin->slots[i] == addr;
+        }
     }
+#if A2ALLOC_RSEQ
+    if (!twice) twice = cpu_cache_holds(seg_idx, addr);
+#endif
 
-    maybe_move_to_heap_zero(heap_idx);
+    if (twice) {
+        fprintf(stderr, "[free_small] double free of %p\n", addr);
+        abort();
+    }
+}
+#endif
+
+void free_small (void * addr, struct page_info * info)
+{
+    assert(region_holds(addr));
+
+    struct superblock * sb = (struct superblock *) info->hdr;
+    assert(sb != NULL);
+    assert(region_of(sb) == region_of(addr));
+
+    unsigned int seg_idx = info->seg_idx;
+    assert(SEG_SIZES[seg_idx] == sb->seg_size);
+    struct tcache_bin * bin = &tcache[seg_idx];
+    unsigned int limit = tcache_limit(seg_idx);
+
+#if SB_FREE_TRACKING == SB_TRACK_BITMAP
+    check_double_free(sb, seg_idx, addr);
+#endif
 
-    pthread_mutex_unlock(&(heap[heap_idx].heap_lock));
+    if (A2ALLOC_POISON & POISON_ON_FREE) {
+        memset(addr, FREED_MEM_CHAR, sb->seg_size);
+    }
+
+#if A2ALLOC_RSEQ
+    int pushed = cpu_cache_push(seg_idx, addr, limit);
+    if (pushed == 0) {
+        cpu_cache_flush(seg_idx);
+        pushed = cpu_cache_push(seg_idx, addr, limit);
+    }
+    // if it's full again we've been migrated; fall back to the thread cache
+    if (pushed == 1) return;
+#endif
+
+    if (bin->count >= limit) {
+        // keep half, so that alternating malloc/free doesn't flush every time
+        tcache_flush(seg_idx, limit / 2);
+    }
+
+    DEBUG(DB_FREE, "[free_small] Caching segment %p of size %u\n", addr, sb->seg_size);
+    tcache_push(bin, addr);
 }
 
 
@@ -825,20 +3421,20 @@ void mm_free(void * addr)
     DEBUG(DB_FREE, "[mm_free] Trying to free memory starting at address %p\n", addr);
     if (addr == NULL) return;
 
-    //if address is in large_list remove it and we're done for now
-    // we need the large lock for find_in_large_list
-    struct largeblock *lb = find_in_large_list(addr);
-    if (lb != NULL) {
-        pthread_mutex_lock(&large_lock);
+    // the page map knows what kind of block this is without searching
+    struct page_info * info = pagemap_lookup(addr);
+    assert(info != NULL);
+
+    if (info->kind == PAGE_LARGE) {
+        struct largeblock * lb = (struct largeblock *) info->hdr;
         DEBUG(DB_FREE, "[mm_free] before going into free_large %p\n", lb);
-        DEBUG(DB_FREE, "[mm_free] lb next is: %p, prev is: %p\n", lb->next, lb->prev);
         DEBUG(DB_FREE, "[mm_free] lb size is: %d\n", lb->size);
-        if(lb != NULL) {
-            free_large(addr, lb);
-        }
-        pthread_mutex_unlock(&large_lock);
+        free_large(addr, lb);
+    } else if (info->kind == PAGE_HUGE) {
+        free_huge(addr, (struct largeblock *) info->hdr);
     } else {
-        // we no longer need the lock, since this is not a large list operation
-        free_small(addr);
+        // anything else is a block freed twice, or never handed out
+        assert(info->kind == PAGE_SMALL);
+        free_small(addr, info);
     }
 }
@@ -1,6 +1,7 @@
 #include <sys/types.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <strings.h>
 #include <unistd.h>
 #include <assert.h>
@@ -502,6 +503,27 @@ static void *big_kmalloc(int sz)
 	return result;
 }
 
+/* Usable size of an allocated block; call with malloc_lock held */
+static size_t block_size(void *ptr)
+{
+	vaddr_t ptraddr = (vaddr_t)ptr;
+	struct pageref *pr;
+	int i;
+
+	for (i=0; i < NSIZES; i++) {
+		for (pr = sizebases[i]; pr; pr = pr->next) {
+			vaddr_t prpage = PR_PAGEADDR(pr);
+			if (ptraddr >= prpage && ptraddr < prpage + PAGE_SIZE) {
+				return sizes[PR_BLOCKTYPE(pr)];
+			}
+		}
+	}
+
+	/* Not a subpage block, so the page count is in front of it */
+	int *hdr_ptr = (int *)((char *)ptr - SMALLEST_SUBPAGE_SIZE);
+	return (size_t)*hdr_ptr * PAGE_SIZE - SMALLEST_SUBPAGE_SIZE;
+}
+
 static void big_kfree(void *ptr)
 {
 	/* Coalescing is unlikely to do much good (other page allocations
@@ -549,6 +571,21 @@ mm_malloc(size_t sz)
 	return result;
 }
 
+void *
+mm_calloc(size_t nmemb, size_t sz)
+{
+	void *result;
+
+	if (sz != 0 && nmemb > (size_t)-1 / sz) {
+		return NULL;
+	}
+	result = mm_malloc(nmemb * sz);
+	if (result != NULL) {
+		bzero(result, nmemb * sz);
+	}
+	return result;
+}
+
 void
 mm_free(void *ptr)
 {
@@ -566,3 +603,31 @@ mm_free(void *ptr)
 	}
 }
 
+void *
+mm_realloc(void *ptr, size_t sz)
+{
+	size_t oldsz;
+	void *result;
+
+	if (ptr == NULL) {
+		return mm_malloc(sz);
+	}
+	if (sz == 0) {
+		mm_free(ptr);
+		return NULL;
+	}
+
+	pthread_mutex_lock(&malloc_lock);
+	oldsz = block_size(ptr);
+	pthread_mutex_unlock(&malloc_lock);
+	if (sz <= oldsz) {
+		return ptr;
+	}
+
+	result = mm_malloc(sz);
+	if (result != NULL) {
+		memcpy(result, ptr, oldsz);
+		mm_free(ptr);
+	}
+	return result;
+}
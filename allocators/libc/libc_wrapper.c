@@ -6,6 +6,16 @@ void *mm_malloc(size_t sz)
   return malloc(sz);
 }
 
+void *mm_calloc(size_t nmemb, size_t sz)
+{
+  return calloc(nmemb, sz);
+}
+
+void *mm_realloc(void *ptr, size_t sz)
+{
+  return realloc(ptr, sz);
+}
+
 void mm_free(void *ptr)
 {
   free(ptr);
@@ -45,6 +45,7 @@
 #include "memlib.h"
 #include "timer.h"
 #include "malloc.h"
+#include "a2alloc.h"
 
 // This struct just holds arguments to each thread.
 struct workerArg {
@@ -116,6 +117,7 @@ int main (int argc, char * argv[])
   printf("Got freq of %lf MHz\n",freq/1e6);
   /* Call allocator-specific initialization function */
   mm_init();
+  a2alloc_print_config(stdout);
 
   // Allocate nthreads objects and distribute them among the threads.
   char ** objs = (char **)mm_malloc(nthreads * sizeof(char *));
@@ -22,7 +22,7 @@ if (!-e "$dir/Results") {
 # Initialize list of allocators to test.
 #my @namelist = ("libc", "kheap", "a2alloc");
 #my @namelist = ("libc", "kheap");
-my @namelist = ("a2alloc", "kheap");
+my @namelist = ("a2alloc", "a2alloc-bitmap", "kheap");
 my $name;
 
 foreach $name (@namelist) {
@@ -30,15 +30,33 @@
  *  cache-thrash-hoard P 1000 1 1000000
  *
  *  The ideal is a P-fold speedup.
+ *
+ *  With a fifth argument of 1 the threads measure interference between the
+ *  allocator's own per-processor data instead: each iteration allocates a
+ *  burst of BURST objects, more than a thread or CPU cache holds, writes
+ *  each of them as many times as in the default mode, and frees them again,
+ *  so every thread keeps going to its heap. With 0 repetitions only the
+ *  allocator touches memory. The hardware counters (cache misses and
+ *  references, where perf_event_open allows them) are summed over the
+ *  threads and printed; on an allocator without false sharing between heaps
+ *  the misses per thread stay flat as P grows.
+ *
+ *  cache-thrash P 1000 8 0 1
 */
 
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
 
 #include "mm_thread.h"
 #include "timer.h"
 #include "malloc.h"
+#include "a2alloc.h"
 #include "memlib.h"
 
 // This struct just holds arguments to each thread.
@@ -49,6 +67,70 @@ struct workerArg {
   int _cpu;
 };
 
+// Objects allocated at once in heap mode
+#define BURST 512
+
+int heapMode = 0;
+
+// Hardware counters summed over all threads; perfFailed is set if any
+// thread couldn't read its counters
+long cacheMisses = 0;
+long cacheRefs = 0;
+int perfFailed = 0;
+
+
+// Open a counter of the calling thread's user-space events of the given
+// kind, stopped; return its descriptor or -1
+int perf_open (unsigned long long config)
+{
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = PERF_TYPE_HARDWARE;
+  attr.config = config;
+  attr.disabled = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  return syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+// Stop a counter and add what it counted to *total, or set perfFailed if
+// there's no counter
+void perf_close (int fd, long * total)
+{
+  long long count;
+  if (fd < 0 || ioctl(fd, PERF_EVENT_IOC_DISABLE, 0) != 0 ||
+      read(fd, &count, sizeof(count)) != sizeof(count)) {
+    __atomic_store_n(&perfFailed, 1, __ATOMIC_RELAXED);
+  } else {
+    __atomic_add_fetch(total, count, __ATOMIC_RELAXED);
+  }
+  if (fd >= 0) close(fd);
+}
+
+
+void heap_worker (struct workerArg * w)
+{
+  char * objs[BURST];
+  int i, j, k, r;
+
+  for (i = 0; i < w->_iterations; i++) {
+    for (j = 0; j < BURST; j++) {
+      objs[j] = (char *)mm_malloc(w->_objSize);
+    }
+    for (r = 0; r < w->_repetitions; r++) {
+      for (j = 0; j < BURST; j++) {
+        for (k = 0; k < w->_objSize; k++) {
+          objs[j][k] = (char) k;
+        }
+      }
+    }
+    for (j = 0; j < BURST; j++) {
+      mm_free(objs[j]);
+    }
+  }
+}
+
 
 extern void * worker (void * arg)
 {
@@ -61,6 +143,18 @@ extern void * worker (void * arg)
   struct workerArg * w = (struct workerArg *) arg;
   setCPU(w->_cpu);
 
+  if (heapMode) {
+    int misses = perf_open(PERF_COUNT_HW_CACHE_MISSES);
+    int refs = perf_open(PERF_COUNT_HW_CACHE_REFERENCES);
+    if (misses >= 0) ioctl(misses, PERF_EVENT_IOC_ENABLE, 0);
+    if (refs >= 0) ioctl(refs, PERF_EVENT_IOC_ENABLE, 0);
+    heap_worker(w);
+    perf_close(misses, &cacheMisses);
+    perf_close(refs, &cacheRefs);
+    mm_free(w);
+    return NULL;
+  }
+
   for (i = 0; i < w->_iterations; i++) {
     // Allocate the object.
     char * obj = (char *)mm_malloc(w->_objSize);
@@ -93,10 +187,14 @@ int main (int argc, char * argv[])
     objSize = atoi(argv[3]);
     repetitions = atoi(argv[4]);
   } else {
-    fprintf (stderr, "Usage: %s nthreads iterations objSize repetitions\n", argv[0]);
+    fprintf (stderr, "Usage: %s nthreads iterations objSize repetitions [heap mode]\n", argv[0]);
     exit(1);
   }
 
+  if (argc > 5) {
+    heapMode = atoi(argv[5]);
+  }
+
   pthread_t threads[nthreads];
   int numCPU = getNumProcessors();
 
@@ -104,6 +202,7 @@ int main (int argc, char * argv[])
 
   /* Call allocator-specific initialization function */
   mm_init();
+  a2alloc_print_config(stdout);
 
   pthread_attr_t attr;
   initialize_pthread_attr(PTHREAD_CREATE_JOINABLE, SCHED_RR, -10, PTHREAD_EXPLICIT_SCHED, 
@@ -128,5 +227,15 @@ int main (int argc, char * argv[])
 
   printf ("Time elapsed = %f seconds\n", t);
   printf ("Memory used = %ld bytes\n",mem_usage());
+  if (heapMode) {
+    if (perfFailed) {
+      printf ("Cache misses = unavailable\n");
+    } else {
+      printf ("Cache misses = %ld (%.1f per thread per iteration)\n", cacheMisses,
+              (double) cacheMisses / nthreads / iterations);
+      printf ("Cache references = %ld\n", cacheRefs);
+    }
+  }
+  a2alloc_print_stats(stdout);
   return 0;
 }
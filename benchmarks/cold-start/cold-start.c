@@ -0,0 +1,121 @@
+/**
+ * @file cold-start.c
+ *
+ * Measure how fast a freshly started allocator grows when every thread
+ * needs memory at the same moment.
+ *
+ * All threads wait at a barrier, then each allocates a burst of objects
+ * spread over all the small size classes, with a large block every so
+ * often, and touches every one. Nothing has been freed yet, so every refill
+ * has to make new superblocks; how long the slowest thread takes shows how
+ * much the threads queue behind each other while the heaps grow.
+ */
+
+#ifndef _REENTRANT
+#define _REENTRANT
+#endif
+
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mm_thread.h"
+#include "timer.h"
+#include "malloc.h"
+#include "a2alloc.h"
+#include "memlib.h"
+
+int nobjects = 20000;	// Default number of objects per thread.
+int nthreads = 1;	// Default number of threads.
+
+static const size_t sizes[] = { 8, 24, 56, 120, 248, 504, 1016, 2040 };
+#define NUM_SIZES (sizeof(sizes) / sizeof(sizes[0]))
+
+// every LARGE_EVERY-th object is a large block of LARGE_SIZE bytes
+#define LARGE_EVERY 64
+#define LARGE_SIZE  6000
+
+pthread_barrier_t go;
+void *** objs;
+
+
+extern void * worker (void *arg)
+{
+  int i;
+#pragma GCC diagnostic ignored "-Wpointer-to-int-cast"
+  int id = (int)arg; // thread number will fit in an int, ignore warning
+#pragma GCC diagnostic pop
+  void ** a = objs[id];
+
+  setCPU(id % getNumProcessors());
+  pthread_barrier_wait(&go);
+
+  for (i = 0; i < nobjects; i++) {
+    size_t size = i % LARGE_EVERY == LARGE_EVERY - 1 ? LARGE_SIZE : sizes[i % NUM_SIZES];
+    a[i] = mm_malloc(size);
+    assert(a[i]);
+    memset(a[i], id, size);
+  }
+
+  return NULL;
+}
+
+
+int main (int argc, char * argv[])
+{
+
+  if (argc >= 2) {
+    nthreads = atoi(argv[1]);
+  }
+
+  if (argc >= 3) {
+    nobjects = atoi(argv[2]);
+  }
+
+  printf ("Running cold-start for %d threads and %d objects...\n", nthreads, nobjects);
+
+  /* Call allocator-specific initialization function */
+  mm_init();
+  a2alloc_print_config(stdout);
+
+  // the object arrays come from libc, so the allocator starts out cold
+  pthread_t *threads = (pthread_t *)malloc(nthreads*sizeof(pthread_t));
+  objs = (void ***)malloc(nthreads*sizeof(void **));
+
+  int i, j;
+  for (i = 0; i < nthreads; i++) {
+    objs[i] = (void **)malloc(nobjects * sizeof(void *));
+  }
+  pthread_barrier_init(&go, NULL, nthreads + 1);
+
+  for (i = 0; i < nthreads; i++) {
+    pthread_create(&threads[i], NULL, &worker, (void *)((u_int64_t)i));
+  }
+
+  timer_start();
+  pthread_barrier_wait(&go);
+
+  for (i = 0; i < nthreads; i++) {
+    pthread_join(threads[i], NULL);
+  }
+
+  double t = timer_stop();
+
+  printf ("Time elapsed = %f seconds\n", t);
+  printf ("Memory used = %ld bytes\n",mem_usage());
+  a2alloc_print_stats(stdout);
+
+  for (i = 0; i < nthreads; i++) {
+    for (j = 0; j < nobjects; j++) {
+      mm_free(objs[i][j]);
+    }
+    free(objs[i]);
+  }
+  free(objs);
+  free(threads);
+  pthread_barrier_destroy(&go);
+
+  return 0;
+}
@@ -0,0 +1,128 @@
+/**
+ * @file fragmentation.c
+ *
+ * Measures how much memory the allocator needs to hold a set of small live
+ * objects, relative to the bytes actually requested. Memory used is how much
+ * the process's resident set grew since just before the first allocation,
+ * so it counts the pages the allocator touched (live objects, superblock
+ * and region headers, metadata) and not address space it merely reserved.
+ * mem_usage() is printed too, but it moves in whole heap chunks.
+ *
+ * Object sizes are drawn the same way larson draws them
+ * (min_size + rand() % (max_size - min_size)), so the defaults reproduce
+ * larson's 8-40 byte input. After the initial allocation, each round frees
+ * and reallocates every object slot at random, to include the fragmentation
+ * left behind by churn.
+ *
+ * Usage: fragmentation [min_size max_size nobjects rounds seed]
+ */
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "malloc.h"
+#include "a2alloc.h"
+#include "memlib.h"
+
+int min_size = 8;
+int max_size = 40;
+int nobjects = 100000;
+int rounds = 10;
+unsigned int seed = 1;
+
+int next_size(void)
+{
+  if (max_size == min_size) {
+    return min_size;
+  }
+  return min_size + rand_r(&seed) % (max_size - min_size);
+}
+
+long rss_start;
+
+/* Resident set size in bytes, read without stdio so libc's malloc stays out of it */
+long resident_bytes(void)
+{
+  char buf[128];
+  long size, resident;
+  int fd = open("/proc/self/statm", O_RDONLY);
+  assert(fd >= 0);
+  ssize_t n = read(fd, buf, sizeof(buf) - 1);
+  close(fd);
+  assert(n > 0);
+  buf[n] = '\0';
+  assert(sscanf(buf, "%ld %ld", &size, &resident) == 2);
+  return resident * sysconf(_SC_PAGESIZE);
+}
+
+void report(const char *phase, long requested)
+{
+  long used = resident_bytes() - rss_start;
+  printf("%-8s Memory used = %ld bytes, required %ld, ratio %lf (mem_usage %ld)\n",
+	 phase, used, requested, (double)used / requested, (long)mem_usage());
+}
+
+int main(int argc, char *argv[])
+{
+  if (argc > 5) {
+    min_size = atoi(argv[1]);
+    max_size = atoi(argv[2]);
+    nobjects = atoi(argv[3]);
+    rounds = atoi(argv[4]);
+    seed = atoi(argv[5]);
+  } else if (argc > 1) {
+    fprintf(stderr, "Usage: %s [min_size max_size nobjects rounds seed]\n", argv[0]);
+    exit(1);
+  }
+
+  printf("Running fragmentation for sizes %d-%d, %d objects, %d rounds...\n",
+	 min_size, max_size, nobjects, rounds);
+
+  /* Call allocator-specific initialization function */
+  mm_init();
+  a2alloc_print_config(stdout);
+
+  char **objs = (char **)malloc(nobjects * sizeof(char *));
+  int *sizes = (int *)malloc(nobjects * sizeof(int));
+  long requested = 0;
+  int i, r;
+
+  /* our own arrays are resident before we start counting */
+  memset(objs, 0, nobjects * sizeof(char *));
+  memset(sizes, 0, nobjects * sizeof(int));
+  rss_start = resident_bytes();
+
+  for (i = 0; i < nobjects; i++) {
+    sizes[i] = next_size();
+    objs[i] = (char *)mm_malloc(sizes[i]);
+    assert(objs[i] != NULL);
+    requested += sizes[i];
+  }
+  report("initial", requested);
+
+  for (r = 0; r < rounds; r++) {
+    for (i = 0; i < nobjects; i++) {
+      int victim = rand_r(&seed) % nobjects;
+      mm_free(objs[victim]);
+      requested -= sizes[victim];
+
+      sizes[victim] = next_size();
+      objs[victim] = (char *)mm_malloc(sizes[victim]);
+      assert(objs[victim] != NULL);
+      requested += sizes[victim];
+    }
+  }
+  report("churned", requested);
+
+  for (i = 0; i < nobjects; i++) {
+    mm_free(objs[i]);
+  }
+  free(objs);
+  free(sizes);
+
+  return 0;
+}
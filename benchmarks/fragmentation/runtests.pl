@@ -0,0 +1,50 @@
+#!/usr/bin/perl
+
+use strict;
+
+# Check for correct usage
+if (@ARGV != 2) {
+  print "usage: runtests.pl <dir> <iters>\n";
+  print "    where <dir> is the directory containing the test executable and\n";
+  print "    Results subdirectory, and <iters> is the number of trials to perform.\n";
+  die;
+}
+
+my $dir = $ARGV[0];
+my $iters = $ARGV[1];
+
+#Ensure existence of $dir/Results
+if (!-e "$dir/Results") {
+    mkdir "$dir/Results", 0755
+	or die "Cannot make $dir/Results: $!";
+}
+
+# Initialize list of allocators to test.
+my @namelist = ("libc", "kheap", "a2alloc");
+my $name;
+
+# larson's input range, plus a wider small-object range
+my @ranges = ("8 40", "8 256");
+my $range;
+
+foreach $name (@namelist) {
+    print "name = $name\n";
+    # Create subdirectory for current allocator results
+    if (!-e "$dir/Results/$name") {
+	mkdir "$dir/Results/$name", 0755
+	    or die "Cannot make $dir/Results/$name: $!";
+    }
+
+    foreach $range (@ranges) {
+	my $file = $range;
+	$file =~ s/ /-/;
+	my $cmd1 = "echo \"\" > $dir/Results/$name/fragmentation-$file";
+	system "$cmd1";
+	for (my $j = 1; $j <= $iters; $j++) {
+	    print "Iteration $j\n";
+	    my $cmd = "$dir/fragmentation-$name $range 100000 10 $j >> $dir/Results/$name/fragmentation-$file 2>&1";
+	    print "$cmd\n";
+	    system "$cmd";
+	}
+    }
+}
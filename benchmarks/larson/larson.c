@@ -12,6 +12,7 @@
 
 #include "mm_thread.h"
 #include "malloc.h"
+#include "a2alloc.h"
 
 typedef void * LPVOID;
 typedef long long LONGLONG;
@@ -230,6 +231,7 @@ int main (int argc, char *argv[])
 
   // Call allocator-specific initialization function
   mm_init();
+  a2alloc_print_config(stdout);
 
   numCPU=getNumProcessors();
 
@@ -20,7 +20,7 @@ if (!-e "$dir/Results") {
 }
 
 # Initialize list of allocators to test.
-my @namelist = ("a2alloc");
+my @namelist = ("a2alloc", "a2alloc-bitmap");
 #my @namelist = ("kheap");
 #my @namelist = ("a2alloc", "kheap");
 
@@ -29,6 +29,7 @@
 #include "mm_thread.h"
 #include "timer.h"
 #include "malloc.h"
+#include "a2alloc.h"
 #include "memlib.h"
 
 #define USECSPERSEC 1000000
@@ -82,6 +83,7 @@ main (int argc, char *argv[])
 
   /* Call allocator-specific initialization function */
   mm_init();
+  a2alloc_print_config(stdout);
 
   executionTime = (double *) mm_malloc (sizeof(double) * thread_count);
   if (executionTime == NULL) {
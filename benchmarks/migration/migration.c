@@ -0,0 +1,163 @@
+/**
+ * @file migration.c
+ *
+ * Stress superblock migration between the per-processor heaps and the
+ * global heap, in both directions.
+ *
+ * Each thread repeatedly allocates a burst of objects spread over all the
+ * small size classes and then frees it. Freeing a whole burst empties
+ * superblocks and pushes them past the emptiness threshold, so they move to
+ * the global heap; the next burst then pulls them back out, often for a
+ * different size class. Every other object of a burst is handed to the next
+ * thread instead, which frees it remotely, so superblocks also get emptied
+ * by threads that do not own them.
+ */
+
+#ifndef _REENTRANT
+#define _REENTRANT
+#endif
+
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "mm_thread.h"
+#include "timer.h"
+#include "malloc.h"
+#include "a2alloc.h"
+#include "memlib.h"
+
+int niterations = 200;	// Default number of iterations.
+int nobjects = 4000;	// Default number of objects per burst.
+int nthreads = 1;	// Default number of threads.
+
+// Objects handed from one thread to the next, freed by the receiver
+struct mailbox {
+  pthread_mutex_t lock;
+  void ** objs;
+  int count;
+} __attribute__((aligned(64)));
+
+struct mailbox * mailboxes;
+
+static const size_t sizes[] = { 8, 24, 56, 120, 248, 504, 1016, 2040 };
+#define NUM_SIZES (sizeof(sizes) / sizeof(sizes[0]))
+
+
+void drain_mailbox (struct mailbox * box)
+{
+  int i;
+  pthread_mutex_lock(&box->lock);
+  for (i = 0; i < box->count; i++) {
+    mm_free(box->objs[i]);
+  }
+  box->count = 0;
+  pthread_mutex_unlock(&box->lock);
+}
+
+
+extern void * worker (void *arg)
+{
+  int i, j;
+#pragma GCC diagnostic ignored "-Wpointer-to-int-cast"
+  int id = (int)arg; // thread number will fit in an int, ignore warning
+#pragma GCC diagnostic pop
+  struct mailbox * mine = &mailboxes[id];
+  struct mailbox * next = &mailboxes[(id + 1) % nthreads];
+  void ** a;
+
+  setCPU(id % getNumProcessors());
+
+  a = (void **)mm_malloc(nobjects * sizeof(void *));
+
+  for (j = 0; j < niterations; j++) {
+    // rotate the classes every round, so superblocks coming back from the
+    // global heap are usually reused for a different class
+    for (i = 0; i < nobjects; i++) {
+      a[i] = mm_malloc(sizes[(i + j) % NUM_SIZES]);
+      assert(a[i]);
+      *(char *)a[i] = (char)i;
+    }
+
+    // pass half of the burst on, unless the receiver is behind
+    pthread_mutex_lock(&next->lock);
+    for (i = 1; i < nobjects && next->count < nobjects; i += 2) {
+      next->objs[next->count++] = a[i];
+      a[i] = NULL;
+    }
+    pthread_mutex_unlock(&next->lock);
+
+    for (i = 0; i < nobjects; i++) {
+      if (a[i] != NULL) mm_free(a[i]);
+    }
+
+    drain_mailbox(mine);
+  }
+
+  mm_free(a);
+
+  return NULL;
+}
+
+
+int main (int argc, char * argv[])
+{
+
+  if (argc >= 2) {
+    nthreads = atoi(argv[1]);
+  }
+
+  if (argc >= 3) {
+    niterations = atoi(argv[2]);
+  }
+
+  if (argc >= 4) {
+    nobjects = atoi(argv[3]);
+  }
+
+  printf ("Running migration for %d threads, %d iterations and %d objects...\n", nthreads, niterations, nobjects);
+
+  /* Call allocator-specific initialization function */
+  mm_init();
+  a2alloc_print_config(stdout);
+
+  pthread_t *threads = (pthread_t *)mm_malloc(nthreads*sizeof(pthread_t));
+  mailboxes = (struct mailbox *)mm_malloc(nthreads*sizeof(struct mailbox));
+
+  int i;
+  for (i = 0; i < nthreads; i++) {
+    pthread_mutex_init(&mailboxes[i].lock, NULL);
+    mailboxes[i].objs = (void **)mm_malloc(nobjects * sizeof(void *));
+    mailboxes[i].count = 0;
+  }
+
+  timer_start();
+
+  for (i = 0; i < nthreads; i++) {
+    pthread_create(&threads[i], NULL, &worker, (void *)((u_int64_t)i));
+  }
+
+  for (i = 0; i < nthreads; i++) {
+    pthread_join(threads[i], NULL);
+  }
+
+  // whatever the last rounds handed on is still waiting
+  for (i = 0; i < nthreads; i++) {
+    drain_mailbox(&mailboxes[i]);
+  }
+
+  double t = timer_stop();
+
+  printf ("Time elapsed = %f seconds\n", t);
+  printf ("Memory used = %ld bytes\n",mem_usage());
+  a2alloc_print_stats(stdout);
+
+  for (i = 0; i < nthreads; i++) {
+    mm_free(mailboxes[i].objs);
+  }
+  mm_free(mailboxes);
+  mm_free(threads);
+
+  return 0;
+}
@@ -0,0 +1,192 @@
+/**
+ * @file mixed-size.c
+ *
+ * Measure how much threads sharing a heap get in each other's way when
+ * they allocate different sizes.
+ *
+ * Threads are pinned round robin to the CPUs, so with more threads than
+ * CPUs several of them share a CPU and its heap. Each thread keeps a
+ * working set of objects and keeps replacing a random one with an object
+ * of a random size, drawn from small and large size classes alike. Every
+ * fourth object it lets go of is handed to the next thread instead, which
+ * frees it remotely. With one lock per heap every size contends with every
+ * other; the per-size lock waits a2alloc reports at the end show how much
+ * of that is left.
+ */
+
+#ifndef _REENTRANT
+#define _REENTRANT
+#endif
+
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "mm_thread.h"
+#include "timer.h"
+#include "malloc.h"
+#include "a2alloc.h"
+#include "memlib.h"
+
+int niterations = 100000;	// Default number of replacements per thread.
+int nobjects = 2000;	// Default number of objects per thread.
+int nthreads = 1;	// Default number of threads.
+
+// Objects handed from one thread to the next, freed by the receiver
+struct mailbox {
+  pthread_mutex_t lock;
+  void ** objs;
+  int count;
+} __attribute__((aligned(64)));
+
+struct mailbox * mailboxes;
+
+static const size_t sizes[] = { 8, 16, 48, 96, 200, 400, 800, 1600 };
+#define NUM_SIZES (sizeof(sizes) / sizeof(sizes[0]))
+
+// how many objects fit in a mailbox before the sender frees its own
+#define MAILBOX_SIZE 256
+
+
+void drain_mailbox (struct mailbox * box)
+{
+  int i;
+  pthread_mutex_lock(&box->lock);
+  for (i = 0; i < box->count; i++) {
+    mm_free(box->objs[i]);
+  }
+  box->count = 0;
+  pthread_mutex_unlock(&box->lock);
+}
+
+
+// xorshift, so the threads don't contend on rand()'s state
+static unsigned int next_random (unsigned int * state)
+{
+  unsigned int x = *state;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  *state = x;
+  return x;
+}
+
+
+extern void * worker (void *arg)
+{
+  int i, j;
+#pragma GCC diagnostic ignored "-Wpointer-to-int-cast"
+  int id = (int)arg; // thread number will fit in an int, ignore warning
+#pragma GCC diagnostic pop
+  struct mailbox * mine = &mailboxes[id];
+  struct mailbox * next = &mailboxes[(id + 1) % nthreads];
+  unsigned int seed = 2463534242u + id;
+  void ** a;
+
+  setCPU(id % getNumProcessors());
+
+  a = (void **)mm_malloc(nobjects * sizeof(void *));
+
+  for (i = 0; i < nobjects; i++) {
+    a[i] = mm_malloc(sizes[next_random(&seed) % NUM_SIZES]);
+    assert(a[i]);
+  }
+
+  for (j = 0; j < niterations; j++) {
+    unsigned int r = next_random(&seed);
+    i = r % nobjects;
+
+    if ((r >> 16) % 4 == 0) {
+      pthread_mutex_lock(&next->lock);
+      if (next->count < MAILBOX_SIZE) {
+        next->objs[next->count++] = a[i];
+        a[i] = NULL;
+      }
+      pthread_mutex_unlock(&next->lock);
+    }
+    if (a[i] != NULL) mm_free(a[i]);
+
+    a[i] = mm_malloc(sizes[(r >> 8) % NUM_SIZES]);
+    assert(a[i]);
+    *(char *)a[i] = (char)j;
+
+    if (j % 64 == 0) {
+      drain_mailbox(mine);
+    }
+  }
+
+  for (i = 0; i < nobjects; i++) {
+    mm_free(a[i]);
+  }
+  mm_free(a);
+
+  return NULL;
+}
+
+
+int main (int argc, char * argv[])
+{
+
+  if (argc >= 2) {
+    nthreads = atoi(argv[1]);
+  }
+
+  if (argc >= 3) {
+    niterations = atoi(argv[2]);
+  }
+
+  if (argc >= 4) {
+    nobjects = atoi(argv[3]);
+  }
+
+  printf ("Running mixed-size for %d threads, %d iterations and %d objects...\n", nthreads, niterations, nobjects);
+
+  /* Call allocator-specific initialization function */
+  mm_init();
+  a2alloc_print_config(stdout);
+
+  pthread_t *threads = (pthread_t *)mm_malloc(nthreads*sizeof(pthread_t));
+  mailboxes = (struct mailbox *)mm_malloc(nthreads*sizeof(struct mailbox));
+
+  int i;
+  for (i = 0; i < nthreads; i++) {
+    pthread_mutex_init(&mailboxes[i].lock, NULL);
+    mailboxes[i].objs = (void **)mm_malloc(MAILBOX_SIZE * sizeof(void *));
+    mailboxes[i].count = 0;
+  }
+
+  timer_start();
+
+  for (i = 0; i < nthreads; i++) {
+    pthread_create(&threads[i], NULL, &worker, (void *)((u_int64_t)i));
+  }
+
+  for (i = 0; i < nthreads; i++) {
+    pthread_join(threads[i], NULL);
+  }
+
+  // whatever the last replacements handed on is still waiting
+  for (i = 0; i < nthreads; i++) {
+    drain_mailbox(&mailboxes[i]);
+  }
+
+  double t = timer_stop();
+
+  printf ("Time elapsed = %f seconds\n", t);
+  printf ("Memory used = %ld bytes\n",mem_usage());
+  a2alloc_print_stats(stdout);
+  if (a2alloc_lock_waits) {
+    for (i = 0; i < NUM_SIZES; i++) {
+      printf ("a2alloc lock waits for %zu bytes = %lu\n", sizes[i], a2alloc_lock_waits(sizes[i]));
+    }
+  }
+
+  for (i = 0; i < nthreads; i++) {
+    mm_free(mailboxes[i].objs);
+  }
+  mm_free(mailboxes);
+  mm_free(threads);
+
+  return 0;
+}
@@ -3,6 +3,8 @@
 #include <unistd.h>
 #include <sys/resource.h>
 #include <sys/time.h>
+#include <sys/wait.h>
+#include <signal.h>
 #include <pthread.h>
 #include <stdlib.h>
 #include  <stddef.h>
@@ -12,13 +14,15 @@
 
 #include "mm_thread.h"
 #include "malloc.h"
+#include "a2alloc.h"
+#include "topology.h"
 
 /**
  * This file is just meant as a test - can the allocator allocate proper memory
  */
 const unsigned long SBB_SIZE = 4096;
 const size_t SB_STRUCT_SIZE = 40;
-const size_t LB_STRUCT_SIZE = 24;
+const size_t LB_STRUCT_SIZE = 16;
 
 
 /**
@@ -90,17 +94,20 @@ void test_repeat_malloc_free_large(size_t size) {
     fprintf(stderr, "x is currently: %u\n", x);
     unsigned int i;
 
-    for (i = 0; i < 2; i++) {
+    for (i = 0; i < num_its; i++) {
         addr = mm_malloc(size);
         assert(addr != NULL);
         //NOTE:
-        //addr not the same because largeblocks are reclaimed into superblocks, so we have to reallocate new space for it.
-
+        //a freed largeblock stays a free span, so every later one reuses
+        //its pages and only the first grows the heap
+        if (prev_addr != NULL) {
+            assert (addr == prev_addr);
+        }
         prev_addr = addr;
 
         t2 = mm_malloc(0);
 
-        assert (t2 == top + (i+1) * x * SBB_SIZE);
+        assert (t2 == top + x * SBB_SIZE);
 
         mm_free(addr);
         assert (mm_malloc(0) == t2);
@@ -226,6 +233,122 @@ void test_malloc_small_many(size_t size) {
     free(alloc_addrs);
 }
 
+/**
+ * Allocate a block big enough to be mapped on its own, grow it and free it.
+ * None of that should touch the heap segment, and growing it should keep
+ * its contents
+ */
+void test_realloc_huge(size_t size) {
+    void * top = mm_malloc(0);
+    size_t i;
+
+    unsigned char * addr = mm_malloc(size);
+    assert(addr != NULL);
+    assert(mm_malloc(0) == top);
+    for (i = 0; i < size; i += SBB_SIZE) {
+        addr[i] = (unsigned char) (i / SBB_SIZE);
+    }
+
+    addr = mm_realloc(addr, size * 4);
+    assert(addr != NULL);
+    assert(mm_malloc(0) == top);
+    for (i = 0; i < size; i += SBB_SIZE) {
+        assert(addr[i] == (unsigned char) (i / SBB_SIZE));
+    }
+    addr[size * 4 - 1] = 1;
+
+    mm_free(addr);
+    assert(mm_malloc(0) == top);
+}
+
+/**
+ * Free p, then q, then p again. The second free of p must abort, so that the
+ * same segment isn't handed out twice; it isn't the last one freed, so a
+ * check against only the most recent free won't catch it.
+ * Only allocators that detect double frees (a2alloc's bitmap build, libc)
+ * pass this one
+ */
+void test_double_free(size_t size) {
+    int status;
+    pid_t pid = fork();
+    assert(pid >= 0);
+
+    if (pid == 0) {
+        void * p = mm_malloc(size);
+        void * q = mm_malloc(size);
+        assert(p != NULL && q != NULL);
+
+        mm_free(p);
+        mm_free(q);
+        mm_free(p);
+
+        // still here: show what the missed double free leads to
+        void * a = mm_malloc(size);
+        void * b = mm_malloc(size);
+        void * c = mm_malloc(size);
+        fprintf(stderr, "FAILURE: double free of %p not detected (got %p %p %p)\n", p, a, b, c);
+        _exit(0);
+    }
+
+    assert(waitpid(pid, &status, 0) == pid);
+    assert(WIFSIGNALED(status) && WTERMSIG(status) == SIGABRT);
+}
+
+/**
+ * Run with more than one LLC group (main sets TOPO_LLCS for this one), so
+ * a2alloc puts a heap per LLC between the per-CPU heaps and heap 0.
+ * Freeing a few hundred superblocks' worth of objects, a superblock's
+ * worth of strides at a time so they all empty together, hands them up to
+ * our LLC heap, which must pass what's over LLC_K_THRESH (64) on to heap 0.
+ * Allocating them again must take the LLC heap's first, and reuse them all
+ * without growing. a2alloc_trim must leave the LLC heaps empty.
+ * Only means something for a2alloc; the others pass it trivially
+ */
+void test_llc_heaps(size_t size) {
+    assert(size >= 64 && size < SBB_SIZE / 2);
+    if (a2alloc_llc_superblocks == NULL) return;
+    assert(topo_num_llcs() > 1);
+
+    int stride = SBB_SIZE / size;
+    int num_allocs = 256 * stride;
+    void **alloc_addrs = (void **)malloc(sizeof(void *) * num_allocs);
+    int i, k;
+
+    for (i = 0; i < num_allocs; i++) {
+        alloc_addrs[i] = mm_malloc(size);
+        assert(alloc_addrs[i] != NULL);
+    }
+    void * top = mm_malloc(0);
+    assert(a2alloc_llc_superblocks() == 0);
+
+    // a heap only hands superblocks up once the ones it uses are mostly empty
+    for (k = 0; k < stride; k++) {
+        for (i = k; i < num_allocs; i += stride) {
+            mm_free(alloc_addrs[i]);
+        }
+    }
+    unsigned long parked = a2alloc_llc_superblocks();
+    printf("LLC heaps hold %lu superblocks after freeing\n", parked);
+    assert(parked > 0 && parked <= 64);
+
+    for (i = 0; i < num_allocs; i++) {
+        alloc_addrs[i] = mm_malloc(size);
+        assert(alloc_addrs[i] != NULL);
+    }
+    assert(a2alloc_llc_superblocks() == 0);
+    assert(mm_malloc(0) == top);
+
+    for (k = 0; k < stride; k++) {
+        for (i = k; i < num_allocs; i += stride) {
+            mm_free(alloc_addrs[i]);
+        }
+    }
+    assert(a2alloc_llc_superblocks() > 0);
+    a2alloc_trim();
+    assert(a2alloc_llc_superblocks() == 0);
+    free(alloc_addrs);
+}
+
 void begin_testcase(const char * testcase_name) {
     printf("=========================== %s ===========================\n", testcase_name);
 }
@@ -244,6 +367,10 @@ int main (int argc, char **argv) {
     int TEST_CASE = atoi(argv[1]);
     printf("Running testcase %d\n", TEST_CASE);
 
+    // test 9 needs more than one LLC group, even on a machine with one
+    if (TEST_CASE == 9) {
+        setenv("TOPO_LLCS", "2", 1);
+    }
     mm_init();
 
     switch (TEST_CASE) {
@@ -277,6 +404,21 @@ int main (int argc, char **argv) {
             test_malloc_large_super_many(SBB_SIZE * 2 + 1);
             end_testcase("test_malloc_large_super");
             break;
+        case 7:
+            begin_testcase("test_realloc_huge");
+            test_realloc_huge(16 * 1024 * 1024);
+            end_testcase("test_realloc_huge");
+            break;
+        case 8:
+            begin_testcase("test_double_free");
+            test_double_free(64);
+            end_testcase("test_double_free");
+            break;
+        case 9:
+            begin_testcase("test_llc_heaps");
+            test_llc_heaps(64);
+            end_testcase("test_llc_heaps");
+            break;
     }
 
 
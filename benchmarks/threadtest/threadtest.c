@@ -38,6 +38,7 @@
 #include "mm_thread.h"
 #include "timer.h"
 #include "malloc.h"
+#include "a2alloc.h"
 #include "memlib.h"
 
 int niterations = 50;	// Default number of iterations.
@@ -125,6 +126,7 @@ int main (int argc, char * argv[])
 
   /* Call allocator-specific initialization function */
   mm_init();
+  a2alloc_print_config(stdout);
 
   pthread_t *threads = (pthread_t *)mm_malloc(nthreads*sizeof(pthread_t));
   int numCPU = getNumProcessors();
@@ -148,6 +150,7 @@ int main (int argc, char * argv[])
 
   printf ("Time elapsed = %f seconds\n", t);
   printf ("Memory used = %ld bytes\n",mem_usage());
+  a2alloc_print_stats(stdout);
 
   mm_free(threads);
 
@@ -0,0 +1,115 @@
+#ifndef __A2ALLOC_H_
+#define __A2ALLOC_H_
+
+#include <stdio.h>
+
+/*
+ * Extensions only a2alloc provides. They are declared weak so that the
+ * benchmarks still link against the other allocators, where they are NULL.
+ */
+
+/* Poisoning mode the allocator was built with: "none", "alloc", "free" or "alloc+free" */
+extern const char *a2alloc_poison_mode (void) __attribute__((weak));
+
+/* How many superblocks heaps took from other heaps instead of growing memory */
+extern unsigned long a2alloc_superblocks_stolen (void) __attribute__((weak));
+
+/* Number of per-CPU heaps made so far */
+extern unsigned int a2alloc_heaps_in_use (void) __attribute__((weak));
+
+/* How many free superblocks a2alloc's per-LLC heaps hold right now (0 on
+   machines with a single last-level cache) */
+extern unsigned long a2alloc_llc_superblocks (void) __attribute__((weak));
+
+/* Give the free superblocks of heaps that have been idle since the last
+   call back to the global heap; return how many heaps gave any */
+extern unsigned int a2alloc_fold_idle_heaps (void) __attribute__((weak));
+
+/* Bind the calling thread to the heap for logical worker `worker` (threads
+   of thread pools or fiber runtimes); return the heap's index */
+extern unsigned int a2alloc_bind_heap (unsigned int worker) __attribute__((weak));
+
+/* Go back to picking heaps the way a2alloc was built to */
+extern void a2alloc_unbind_heap (void) __attribute__((weak));
+
+/* How a2alloc picks a thread's heap: "cpu" or "thread" */
+extern const char *a2alloc_heap_policy (void) __attribute__((weak));
+
+/* Kind of lock a2alloc was built with: "pthread", "adaptive" or "ticket" */
+extern const char *a2alloc_lock_kind (void) __attribute__((weak));
+
+/* Print acquisitions, waits and cycles spent waiting for each of a2alloc's
+   locks; only there when a2alloc was built with A2ALLOC_LOCK_STATS=1 */
+extern void a2alloc_print_locks (FILE *f) __attribute__((weak));
+
+/* How many times threads had to wait for a heap's lock for the size class
+   of `size` bytes, or for any class if size is 0 */
+extern unsigned long a2alloc_lock_waits (size_t size) __attribute__((weak));
+
+/* Bytes of freed large blocks a2alloc holds as free spans, waiting to be
+   reused for large blocks or superblocks */
+extern unsigned long a2alloc_free_span_bytes (void) __attribute__((weak));
+
+/* Turn the superblocks heap 0 and the LLC heaps hold into free spans,
+   unmapping regions that leaves wholly free, then give the memory of
+   a2alloc's free spans back to the OS, keeping the spans themselves for
+   reuse; return how many bytes that covered */
+extern unsigned long a2alloc_trim (void) __attribute__((weak));
+
+/* How many regions a2alloc has mapped for its heaps to grow in right now */
+extern unsigned long a2alloc_regions (void) __attribute__((weak));
+
+/* Size from which a2alloc maps blocks one by one instead of carving them
+   out of its heap segment */
+extern unsigned long a2alloc_mmap_threshold (void) __attribute__((weak));
+
+/* Bytes a2alloc has mapped for blocks of at least that size right now */
+extern unsigned long a2alloc_huge_bytes (void) __attribute__((weak));
+
+/* Print how a2alloc was built, if that's the allocator linked in */
+static inline void a2alloc_print_config (FILE *f)
+{
+    if (a2alloc_poison_mode) {
+        fprintf(f, "a2alloc poison mode: %s\n", a2alloc_poison_mode());
+    }
+    if (a2alloc_heap_policy) {
+        fprintf(f, "a2alloc heap policy: %s\n", a2alloc_heap_policy());
+    }
+    if (a2alloc_lock_kind) {
+        fprintf(f, "a2alloc lock kind: %s\n", a2alloc_lock_kind());
+    }
+    if (a2alloc_mmap_threshold) {
+        fprintf(f, "a2alloc mmap threshold: %lu\n", a2alloc_mmap_threshold());
+    }
+}
+
+/* Print a2alloc's counters, if that's the allocator linked in */
+static inline void a2alloc_print_stats (FILE *f)
+{
+    if (a2alloc_superblocks_stolen) {
+        fprintf(f, "a2alloc superblocks stolen = %lu\n", a2alloc_superblocks_stolen());
+    }
+    if (a2alloc_heaps_in_use) {
+        fprintf(f, "a2alloc heaps in use = %u\n", a2alloc_heaps_in_use());
+    }
+    if (a2alloc_llc_superblocks) {
+        fprintf(f, "a2alloc LLC heap superblocks = %lu\n", a2alloc_llc_superblocks());
+    }
+    if (a2alloc_lock_waits) {
+        fprintf(f, "a2alloc lock waits = %lu\n", a2alloc_lock_waits(0));
+    }
+    if (a2alloc_free_span_bytes) {
+        fprintf(f, "a2alloc free span bytes = %lu\n", a2alloc_free_span_bytes());
+    }
+    if (a2alloc_regions) {
+        fprintf(f, "a2alloc regions = %lu\n", a2alloc_regions());
+    }
+    if (a2alloc_huge_bytes) {
+        fprintf(f, "a2alloc huge bytes = %lu\n", a2alloc_huge_bytes());
+    }
+    if (a2alloc_print_locks) {
+        a2alloc_print_locks(f);
+    }
+}
+
+#endif /* __A2ALLOC_H_ */
@@ -12,14 +12,50 @@
 #include <stddef.h>
 
 
-#define DSEG_MAX 256*1024*1024  /* 256 Mb */
+/* Address space mem_init reserves for the data segment, unless the DSEG_MAX
+   environment variable says otherwise. Only what mem_sbrk hands out is
+   ever committed */
+#ifndef DSEG_MAX
+#define DSEG_MAX (64UL*1024*1024*1024)  /* 64 Gb */
+#endif
+
+/* How much more of the data segment mem_sbrk commits at a time */
+#define MEM_COMMIT_CHUNK (1024*1024)
 
 extern char *dseg_lo, *dseg_hi;
 extern long dseg_size;
 
+/* A range of address space mapped on its own and grown like the data
+   segment; lo is aligned to its size */
+struct mem_region {
+    char *lo, *hi;      /* first byte, last byte handed out so far */
+    char *commit;       /* end of the part that has been committed */
+    size_t size;        /* bytes reserved */
+};
+
 extern int mem_init (void);
 extern void *mem_sbrk (ptrdiff_t increment);
+extern int mem_decommit (void *addr, size_t len);
+
+/* Reserve a region of size bytes (a power of two) aligned to its size;
+   return 0 on success */
+extern int mem_region_map (struct mem_region *r, size_t size);
+/* Hand out increment more bytes of the region, or NULL if it's full */
+extern void *mem_region_sbrk (struct mem_region *r, ptrdiff_t increment);
+/* Give the whole region back to the OS */
+extern int mem_region_unmap (struct mem_region *r);
+
+/* Map size bytes of zeroed memory on their own, outside the data segment
+   and regions, for blocks and metadata that don't belong in either; NULL if
+   the OS refuses. Counted in mem_usage until unmapped */
+extern void *mem_map (size_t size);
+/* Resize a mapping made with mem_map, moving it if it can't grow in place;
+   NULL (and the mapping as it was) on failure */
+extern void *mem_remap (void *addr, size_t old_size, size_t new_size);
+extern int mem_unmap (void *addr, size_t size);
 extern int mem_pagesize (void);
+/* Bytes handed out of the data segment and regions, plus those mapped with
+   mem_map */
 extern ptrdiff_t mem_usage (void);
 
 #endif /* __MEMLIB_H_ */
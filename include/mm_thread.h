@@ -23,10 +23,12 @@ extern void initialize_pthread_attr(int detachstate, int schedpolicy, int priori
 				    int inheritsched, int scope, pthread_attr_t *attr);
 
 
+/* Number of online CPUs this process may run on (see topology.h) */
 extern int getNumProcessors (void);
 
 extern int getTID(void);
 
+/* Pin the calling thread to the n-th CPU it may run on, wrapping around */
 extern void setCPU (int n); 
 
 #endif /* _MM_THREAD_H_ */
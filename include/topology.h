@@ -0,0 +1,49 @@
+#ifndef _TOPOLOGY_H_
+#define _TOPOLOGY_H_
+
+/*
+ * CPU topology, read once from sysfs, sched_getaffinity and the cgroup
+ * filesystem. Nothing here calls malloc, so the allocators can use it
+ * before they are initialized. Every query initializes the module on first
+ * use; CPU ids at or above TOPO_MAX_CPUS are ignored.
+ */
+
+#define TOPO_MAX_CPUS 1024
+
+/* Read the topology if that hasn't been done yet (thread-safe) */
+extern void topo_init (void);
+
+/* One more than the highest CPU id the kernel may ever report, so arrays
+   indexed by sched_getcpu() need this many entries */
+extern int topo_cpu_id_limit (void);
+
+/* Number of CPUs currently online */
+extern int topo_num_online (void);
+
+/* Number of online CPUs this process is allowed to run on */
+extern int topo_num_allowed (void);
+
+/* Number of CPUs' worth of time the cgroup CPU quota grants, rounded up and
+   never more than topo_num_allowed() */
+extern int topo_num_usable (void);
+
+/* Whether this process may run on the given CPU, which must be online */
+extern int topo_cpu_allowed (int cpu);
+
+/* The n-th (from 0) allowed CPU, wrapping around, or -1 if there are none */
+extern int topo_nth_allowed (int n);
+
+/* Dense index of the physical core the CPU belongs to; SMT siblings share it */
+extern int topo_core_id (int cpu);
+extern int topo_num_cores (void);
+
+/* Dense index of the last-level cache the CPU shares with others. TOPO_LLCS=n
+   in the environment deals the online CPUs round robin into n groups
+   instead, to try code meant for machines with several LLCs on any machine */
+extern int topo_llc_id (int cpu);
+extern int topo_num_llcs (void);
+
+/* NUMA node of the CPU (0 without NUMA information) */
+extern int topo_numa_node (int cpu);
+
+#endif /* _TOPOLOGY_H_ */
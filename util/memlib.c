@@ -21,53 +21,221 @@ long dseg_size;  /* Maximum size of data segment */
 
 static int page_size;
 
+/*
+ * The data segment is a range of address space reserved PROT_NONE by
+ * mem_init, so it costs nothing until it is used. mem_sbrk moves dseg_hi
+ * with a compare-and-swap and makes the pages below it accessible
+ * MEM_COMMIT_CHUNK bytes at a time; dseg_commit is where that has got to.
+ * Regions (struct mem_region) are more ranges like it, each mapped on its
+ * own, and grow the same way.
+ */
+static char *dseg_commit = NULL;
+
+/* Bytes mem_region_sbrk has handed out of regions still mapped */
+static long region_usage = 0;
+
+/* Bytes of mappings made with mem_map and not unmapped yet */
+static long map_usage = 0;
+
 /* Align pointer to closest page boundary downwards */
 #define PAGE_ALIGN(p)    ((void *)(((unsigned long)(p) / page_size) * page_size))
 /* Align pointer to closest page boundary upwards */
 #define PAGE_ALIGN_UP(p) ((void *)((((unsigned long)(p) + page_size - 1) / page_size) * page_size))
 
+/* Smallest reservation mem_init settles for when a bigger one is refused */
+#define DSEG_MIN (16UL*1024*1024)
 
-
-int mem_init (void)
+/* Get the system page size, if nobody has yet; regions can be used without
+   the data segment, so mem_init may never run */
+static void page_size_init (void)
 {
+    if (__atomic_load_n(&page_size, __ATOMIC_RELAXED) == 0)
+        __atomic_store_n(&page_size, (int) getpagesize(), __ATOMIC_RELAXED);
+}
 
-    /* Get system page size */
-    page_size = (int) getpagesize();
 
-    /* Allocate heap */
-    dseg_lo = (char *) malloc(DSEG_MAX + 2*page_size);
-    if (!dseg_lo)
+int mem_init (void)
+{
+    unsigned long size = DSEG_MAX;
+    char *env = getenv("DSEG_MAX");
+    void *addr;
+
+    page_size_init();
+
+    if (env != NULL && strtoul(env, NULL, 0) > 0) {
+        size = strtoul(env, NULL, 0);
+    }
+    size = (unsigned long) PAGE_ALIGN_UP(size);
+
+    /* Reserve the heap; under an address space limit settle for less */
+    do {
+        addr = mmap(NULL, size, PROT_NONE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    } while (addr == MAP_FAILED && (size /= 2) >= DSEG_MIN);
+    if (addr == MAP_FAILED)
         return -1;
 
-    /* align heap to the next page boundary */
-    dseg_lo = (char *) PAGE_ALIGN_UP(dseg_lo);
+    dseg_lo = (char *) addr;
     dseg_hi = dseg_lo-1;
-    dseg_size = DSEG_MAX;
+    dseg_commit = dseg_lo;
+    dseg_size = size;
 
 
     return 0;
 }
 
 
-void *mem_sbrk (ptrdiff_t increment)
+/*
+ * Make the range starting at lo accessible up to (not including) end.
+ * Callers racing here may mprotect the same pages twice, which is harmless;
+ * *commit only ever moves up, to the end of a part that has been committed
+ */
+static int mem_commit (char *lo, size_t size, char **commit, char *end)
 {
-    char *new_hi = dseg_hi + increment;
-    char *old_hi = dseg_hi;
-    long dseg_cursize = dseg_hi - dseg_lo + 1;
+    char *old_commit = __atomic_load_n(commit, __ATOMIC_ACQUIRE);
+    char *new_commit;
+
+    if (end <= old_commit)
+        return 0;
+
+    new_commit = old_commit + MEM_COMMIT_CHUNK;
+    if (new_commit < end)
+        new_commit = PAGE_ALIGN_UP(end);
+    if (new_commit > lo + size)
+        new_commit = lo + size;
+
+    if (mprotect(old_commit, new_commit - old_commit, PROT_READ | PROT_WRITE) != 0)
+        return -1;
+
+    while (old_commit < new_commit &&
+           !__atomic_compare_exchange_n(commit, &old_commit, new_commit, 1,
+                                        __ATOMIC_RELEASE, __ATOMIC_ACQUIRE))
+        ;
+    return 0;
+}
+
+
+/* Move *hi, the last byte in use of the range starting at lo, up by increment */
+static void *range_sbrk (char *lo, size_t size, char **hi, char **commit, ptrdiff_t increment)
+{
+    char *old_hi, *new_hi;
 
     assert(increment > 0);
 
-    /* Resize data segment, if the memory is available */
-    if (new_hi > dseg_lo + dseg_size)
-        return NULL;
-    dseg_hi = new_hi;
-    dseg_cursize = dseg_hi - dseg_lo + 1;
+    /* Resize the range, if the memory is available. The bytes are committed
+       before they are claimed, so when they don't fit or can't be committed
+       there is no increment to give back */
+    old_hi = __atomic_load_n(hi, __ATOMIC_RELAXED);
+    do {
+        new_hi = old_hi + increment;
+        if (new_hi >= lo + size)
+            return NULL;
+
+        if (new_hi >= __atomic_load_n(commit, __ATOMIC_ACQUIRE) &&
+            mem_commit(lo, size, commit, new_hi + 1) != 0)
+            return NULL;
+    } while (!__atomic_compare_exchange_n(hi, &old_hi, new_hi, 1,
+                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED));
 
     return (void *)(old_hi + 1);
 }
 
+
+void *mem_sbrk (ptrdiff_t increment)
+{
+    return range_sbrk(dseg_lo, dseg_size, &dseg_hi, &dseg_commit, increment);
+}
+
+
+int mem_region_map (struct mem_region *r, size_t size)
+{
+    char *addr, *aligned;
+
+    page_size_init();
+    assert(size > 0 && (size & (size - 1)) == 0 && size % page_size == 0);
+
+    /* Map twice the size, then cut off what's on either side of an aligned one */
+    addr = mmap(NULL, 2 * size, PROT_NONE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (addr == MAP_FAILED)
+        return -1;
+    aligned = (char *)(((unsigned long) addr + size - 1) & ~(size - 1));
+    if (aligned > addr)
+        munmap(addr, aligned - addr);
+    if (aligned + size < addr + 2 * size)
+        munmap(aligned + size, addr + 2 * size - (aligned + size));
+
+    r->lo = aligned;
+    r->hi = aligned - 1;
+    r->commit = aligned;
+    r->size = size;
+    return 0;
+}
+
+
+void *mem_region_sbrk (struct mem_region *r, ptrdiff_t increment)
+{
+    void *addr = range_sbrk(r->lo, r->size, &r->hi, &r->commit, increment);
+    if (addr != NULL)
+        __atomic_add_fetch(&region_usage, increment, __ATOMIC_RELAXED);
+    return addr;
+}
+
+
+int mem_region_unmap (struct mem_region *r)
+{
+    __atomic_sub_fetch(&region_usage, r->hi + 1 - r->lo, __ATOMIC_RELAXED);
+    return munmap(r->lo, r->size);
+}
+
+void *mem_map (size_t size)
+{
+    void *addr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (addr == MAP_FAILED)
+        return NULL;
+    __atomic_add_fetch(&map_usage, size, __ATOMIC_RELAXED);
+    return addr;
+}
+
+
+void *mem_remap (void *addr, size_t old_size, size_t new_size)
+{
+    void *new_addr = mremap(addr, old_size, new_size, MREMAP_MAYMOVE);
+    if (new_addr == MAP_FAILED)
+        return NULL;
+    __atomic_add_fetch(&map_usage, (long) new_size - (long) old_size, __ATOMIC_RELAXED);
+    return new_addr;
+}
+
+
+int mem_unmap (void *addr, size_t size)
+{
+    __atomic_sub_fetch(&map_usage, size, __ATOMIC_RELAXED);
+    return munmap(addr, size);
+}
+
+/*
+ * Give the pages wholly inside [addr, addr + len) back to the OS. They stay
+ * part of the data segment or region and read back as zeros when next
+ * touched.
+ */
+int mem_decommit (void *addr, size_t len)
+{
+    char *begin, *end;
+
+    page_size_init();
+    begin = PAGE_ALIGN_UP(addr);
+    end = PAGE_ALIGN((char *) addr + len);
+
+    if (end <= begin)
+        return 0;
+    return madvise(begin, end - begin, MADV_DONTNEED);
+}
+
 int mem_pagesize (void)
 {
+    page_size_init();
     return page_size;
 }
 
@@ -77,6 +245,7 @@ ptrdiff_t mem_usage (void)
   if (dseg_lo != NULL && dseg_hi == NULL) {
     dseg_hi = sbrk(0);
   }
-  return dseg_hi - dseg_lo;
+  return dseg_hi - dseg_lo + __atomic_load_n(&region_usage, __ATOMIC_RELAXED) +
+         __atomic_load_n(&map_usage, __ATOMIC_RELAXED);
 }
  
@@ -1,4 +1,5 @@
 #include "mm_thread.h"
+#include "topology.h"
 
 
 /* Set thread attributes */
@@ -20,34 +21,10 @@ extern void initialize_pthread_attr(int detachstate, int schedpolicy, int priori
 
 int getNumProcessors (void)
 {
-	static int np = 0;
-	if (!np) {
-		// Ugly workaround.  Linux's sysconf indirectly calls malloc() (at
-		// least on multiprocessors).  So we just read the info from the
-		// proc file ourselves and count the occurrences of the word
-		// "processor".
-  
-	        int MAX_LINE_SIZE = 512;
-		char line[MAX_LINE_SIZE];
-		FILE *fp =fopen ("/proc/cpuinfo", "r");
-		if (!fp) {
-			return 1;
-		} else {
-			char *str;
-			while ( (str = fgets(line, MAX_LINE_SIZE, fp)) != 0) {
-				// Assume processor occurs at most once per line
-				str = strstr(str, "processor");
-				if (str) {
-					np++;
-					str++;
-				}
-			}
-			fclose (fp);
-			return np;
-		}
-	} else {
-		return np;
-	}
+	// Linux's sysconf indirectly calls malloc(), so this comes from the
+	// topology module, which reads sysfs and the affinity mask itself.
+	// Only CPUs we may actually run on count, so cpusets shrink it.
+	return topo_num_allowed();
 }
 
 inline int getTID(void) {
@@ -55,11 +32,15 @@ inline int getTID(void) {
 }
 
 void setCPU (int n) {
-	/* Set CPU affinity to CPU n only. */
+	/* Set CPU affinity to the n-th CPU we're allowed to run on only. */
 	pid_t tid = syscall(__NR_gettid);
+	int cpu = topo_nth_allowed(n);
+	if (cpu < 0) {
+		return;
+	}
 	cpu_set_t mask;
 	CPU_ZERO(&mask);
-	CPU_SET(n, &mask);
+	CPU_SET(cpu, &mask);
 	if (sched_setaffinity(tid, sizeof(cpu_set_t), &mask) != 0) {
 		perror("sched_setaffinity failed");
 	} 
@@ -0,0 +1,340 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include "topology.h"
+
+/*
+ * Everything lives in static tables filled in once by topo_read. Files are
+ * read with plain open/read into stack buffers, and lists are parsed by
+ * hand, because stdio and sysconf may allocate and the allocators call in
+ * here from mm_init.
+ */
+
+#define SYS_CPU "/sys/devices/system/cpu"
+#define SYS_NODE "/sys/devices/system/node"
+
+static pthread_once_t topo_once = PTHREAD_ONCE_INIT;
+
+static int cpu_id_limit;
+static int num_online;
+static int num_allowed;
+static int num_usable;
+static int num_cores;
+static int num_llcs;
+
+static cpu_set_t online;
+static cpu_set_t allowed;
+
+static short core_of[TOPO_MAX_CPUS];
+static short llc_of[TOPO_MAX_CPUS];
+static short node_of[TOPO_MAX_CPUS];
+
+/* Read a small file into buf and NUL-terminate it; return the length or -1 */
+static int read_file (const char *path, char *buf, size_t size)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	ssize_t n = read(fd, buf, size - 1);
+	close(fd);
+	if (n < 0)
+		return -1;
+	buf[n] = '\0';
+	return n;
+}
+
+/* Parse a kernel CPU list like "0-3,8-11" into set; return the number of CPUs */
+static int parse_cpu_list (const char *s, cpu_set_t *set)
+{
+	CPU_ZERO(set);
+	while (*s) {
+		char *end;
+		long lo = strtol(s, &end, 10);
+		if (end == s)
+			break;
+		long hi = lo;
+		s = end;
+		if (*s == '-') {
+			hi = strtol(s + 1, &end, 10);
+			s = end;
+		}
+		for (; lo <= hi && lo < TOPO_MAX_CPUS; lo++)
+			CPU_SET(lo, set);
+		if (*s != ',')
+			break;
+		s++;
+	}
+	return CPU_COUNT(set);
+}
+
+/* Read a CPU list file; return the number of CPUs or -1 */
+static int read_cpu_list (const char *path, cpu_set_t *set)
+{
+	char buf[4096];
+	if (read_file(path, buf, sizeof buf) <= 0)
+		return -1;
+	return parse_cpu_list(buf, set);
+}
+
+/* Lowest CPU in a CPU list file, or -1 */
+static int read_list_leader (const char *path)
+{
+	cpu_set_t set;
+	int cpu;
+	if (read_cpu_list(path, &set) <= 0)
+		return -1;
+	for (cpu = 0; cpu < TOPO_MAX_CPUS; cpu++)
+		if (CPU_ISSET(cpu, &set))
+			return cpu;
+	return -1;
+}
+
+/* Lowest CPU sharing the highest-level cache sysfs lists for cpu, or -1 */
+static int llc_leader (int cpu)
+{
+	char path[128];
+	char buf[64];
+	int best_level = -1;
+	int leader = -1;
+	int idx;
+
+	for (idx = 0; ; idx++) {
+		snprintf(path, sizeof path, SYS_CPU "/cpu%d/cache/index%d/level", cpu, idx);
+		if (read_file(path, buf, sizeof buf) <= 0)
+			break;
+		int level = atoi(buf);
+		if (level < best_level)
+			continue;
+		snprintf(path, sizeof path, SYS_CPU "/cpu%d/cache/index%d/shared_cpu_list", cpu, idx);
+		int l = read_list_leader(path);
+		if (l < 0)
+			continue;
+		best_level = level;
+		leader = l;
+	}
+	return leader;
+}
+
+/* Count in the environment variable name, or 0 if it isn't set or positive */
+static int read_env_count (const char *name)
+{
+	const char *s = getenv(name);
+	int n = s ? atoi(s) : 0;
+	if (n < 0)
+		return 0;
+	return n < TOPO_MAX_CPUS ? n : TOPO_MAX_CPUS;
+}
+
+/*
+ * Give every online CPU a dense group id: CPUs whose leader (the lowest CPU
+ * of their group) is a lower, online CPU join that CPU's group, everyone
+ * else starts a new one. With forced > 0 the online CPUs are dealt round
+ * robin into that many groups instead, some of which may stay empty.
+ * Return the number of groups.
+ */
+static int assign_groups (short *group_of, int (*leader_of)(int), int forced)
+{
+	int groups = 0;
+	int cpu;
+	for (cpu = 0; cpu < cpu_id_limit; cpu++) {
+		if (!CPU_ISSET(cpu, &online))
+			continue;
+		if (forced > 0) {
+			group_of[cpu] = groups++ % forced;
+			continue;
+		}
+		int leader = leader_of(cpu);
+		if (leader >= 0 && leader < cpu && CPU_ISSET(leader, &online))
+			group_of[cpu] = group_of[leader];
+		else
+			group_of[cpu] = groups++;
+	}
+	return forced > 0 ? forced : groups;
+}
+
+static int core_leader (int cpu)
+{
+	char path[128];
+	snprintf(path, sizeof path, SYS_CPU "/cpu%d/topology/thread_siblings_list", cpu);
+	return read_list_leader(path);
+}
+
+static void read_numa_nodes (void)
+{
+	char path[128];
+	cpu_set_t nodes, cpus;
+	int node, cpu;
+
+	if (read_cpu_list(SYS_NODE "/online", &nodes) <= 0)
+		return;
+	for (node = 0; node < TOPO_MAX_CPUS; node++) {
+		if (!CPU_ISSET(node, &nodes))
+			continue;
+		snprintf(path, sizeof path, SYS_NODE "/node%d/cpulist", node);
+		if (read_cpu_list(path, &cpus) <= 0)
+			continue;
+		for (cpu = 0; cpu < TOPO_MAX_CPUS; cpu++)
+			if (CPU_ISSET(cpu, &cpus))
+				node_of[cpu] = node;
+	}
+}
+
+/* CPUs' worth of time the cgroup quota allows, or 0 if there's no quota */
+static int read_cpu_quota (void)
+{
+	char buf[512];
+	char path[600];
+	long quota = -1, period = 0;
+
+	/* cgroup v2: "0::/some/path" in /proc/self/cgroup, "max 100000" or "200000 100000" in cpu.max */
+	if (read_file("/proc/self/cgroup", buf, sizeof buf) > 0) {
+		char *p = strstr(buf, "0::");
+		if (p) {
+			p += 3;
+			char *nl = strchr(p, '\n');
+			if (nl)
+				*nl = '\0';
+			snprintf(path, sizeof path, "/sys/fs/cgroup%s/cpu.max", strcmp(p, "/") ? p : "");
+			if (read_file(path, buf, sizeof buf) > 0 && strncmp(buf, "max", 3) != 0) {
+				char *end;
+				quota = strtol(buf, &end, 10);
+				period = strtol(end, NULL, 10);
+			}
+		}
+	}
+
+	/* cgroup v1 */
+	if (quota <= 0 &&
+	    read_file("/sys/fs/cgroup/cpu/cpu.cfs_quota_us", buf, sizeof buf) > 0) {
+		quota = atol(buf);
+		if (read_file("/sys/fs/cgroup/cpu/cpu.cfs_period_us", buf, sizeof buf) > 0)
+			period = atol(buf);
+	}
+
+	if (quota <= 0 || period <= 0)
+		return 0;
+	return (quota + period - 1) / period;
+}
+
+static void topo_read (void)
+{
+	cpu_set_t possible, mask;
+	int cpu;
+
+	/* without sysfs assume that CPU 0 is all there is */
+	if (read_cpu_list(SYS_CPU "/online", &online) <= 0) {
+		CPU_ZERO(&online);
+		CPU_SET(0, &online);
+	}
+	num_online = CPU_COUNT(&online);
+
+	cpu_id_limit = 0;
+	if (read_cpu_list(SYS_CPU "/possible", &possible) <= 0)
+		possible = online;
+	for (cpu = 0; cpu < TOPO_MAX_CPUS; cpu++)
+		if (CPU_ISSET(cpu, &possible) || CPU_ISSET(cpu, &online))
+			cpu_id_limit = cpu + 1;
+
+	if (sched_getaffinity(0, sizeof mask, &mask) != 0)
+		mask = online;
+	CPU_AND(&allowed, &mask, &online);
+	num_allowed = CPU_COUNT(&allowed);
+	if (num_allowed == 0) {
+		allowed = online;
+		num_allowed = num_online;
+	}
+
+	num_usable = read_cpu_quota();
+	if (num_usable == 0 || num_usable > num_allowed)
+		num_usable = num_allowed;
+
+	num_cores = assign_groups(core_of, core_leader, 0);
+	num_llcs = assign_groups(llc_of, llc_leader, read_env_count("TOPO_LLCS"));
+	read_numa_nodes();
+}
+
+extern void topo_init (void)
+{
+	pthread_once(&topo_once, topo_read);
+}
+
+extern int topo_cpu_id_limit (void)
+{
+	topo_init();
+	return cpu_id_limit;
+}
+
+extern int topo_num_online (void)
+{
+	topo_init();
+	return num_online;
+}
+
+extern int topo_num_allowed (void)
+{
+	topo_init();
+	return num_allowed;
+}
+
+extern int topo_num_usable (void)
+{
+	topo_init();
+	return num_usable;
+}
+
+extern int topo_cpu_allowed (int cpu)
+{
+	topo_init();
+	return cpu >= 0 && cpu < TOPO_MAX_CPUS && CPU_ISSET(cpu, &allowed);
+}
+
+extern int topo_nth_allowed (int n)
+{
+	int cpu;
+	topo_init();
+	if (num_allowed == 0 || n < 0)
+		return -1;
+	n %= num_allowed;
+	for (cpu = 0; cpu < cpu_id_limit; cpu++) {
+		if (CPU_ISSET(cpu, &allowed) && n-- == 0)
+			return cpu;
+	}
+	return -1;
+}
+
+extern int topo_core_id (int cpu)
+{
+	topo_init();
+	return cpu >= 0 && cpu < TOPO_MAX_CPUS ? core_of[cpu] : 0;
+}
+
+extern int topo_num_cores (void)
+{
+	topo_init();
+	return num_cores;
+}
+
+extern int topo_llc_id (int cpu)
+{
+	topo_init();
+	return cpu >= 0 && cpu < TOPO_MAX_CPUS ? llc_of[cpu] : 0;
+}
+
+extern int topo_num_llcs (void)
+{
+	topo_init();
+	return num_llcs;
+}
+
+extern int topo_numa_node (int cpu)
+{
+	topo_init();
+	return cpu >= 0 && cpu < TOPO_MAX_CPUS ? node_of[cpu] : 0;
+}